@@ -39,6 +39,7 @@ class OpenGL_GpuProgram : public GpuProgram {
     int lighting_uniform;
     int texture_uniform;
     int has_texture_uniform;
+    int normal_sign_uniform;
 };
 
 class Close2GL_GpuProgram : public GpuProgram {
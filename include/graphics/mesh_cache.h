@@ -0,0 +1,48 @@
+#ifndef _MESH_CACHE_H
+#define _MESH_CACHE_H
+
+#include <stdint.h>
+#include <string>
+
+#include "graphics/model.h"
+
+#define MESH_CACHE_MAGIC   0x4D434732 // "2GCM"
+#define MESH_CACHE_VERSION 2
+
+#define MESH_CACHE_HAS_TEXTURE            1
+#define MESH_CACHE_HAS_CALCULATED_NORMALS 2
+#define MESH_CACHE_CALCULATED_CCW         4
+
+// Every array follows the header in this order, each one starting at a 
+// 16 byte aligned offset: name, materials, triangles, vertices, normals,
+// calculated normals, raw normals and color indices.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t source_hash;
+  uint64_t source_size;
+  uint32_t triangle_size; // sizeof(model_triangle_t) of the writer
+  uint32_t flags;
+  float    weld_epsilon;
+  float    bounding_box_min[3];
+  float    bounding_box_max[3];
+  uint64_t name_length;
+  uint64_t material_count;
+  uint64_t triangle_count;
+  uint64_t vertex_count;
+  uint64_t normal_count;
+  uint64_t calculated_normal_count;
+  uint64_t raw_normal_count;
+  uint64_t color_index_count;
+} mesh_cache_header_t;
+
+uint64_t HashFileContent(const char* data, size_t size);
+std::string MeshCachePath(const char* source_filename, std::string cache_dir);
+
+// Returns false when the cache is missing, outdated or from another version
+bool ReadMeshCache(const char* cache_filename, uint64_t source_hash, uint64_t source_size, float weld_epsilon, model_t *model);
+// Gives up without a cache once *cancel is set
+void WriteMeshCache(const char* cache_filename, uint64_t source_hash, uint64_t source_size, float weld_epsilon, const model_t &model,
+                    const std::atomic<bool> *cancel = nullptr);
+
+#endif // _MESH_CACHE_H
@@ -3,6 +3,11 @@
 
 #include <algorithm>
 #include <vector>
+#include <memory>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
 #include <iostream>
 #include <sstream>
 #include <fstream>
@@ -20,6 +25,7 @@ typedef struct {
 typedef struct
 {
   int indices[3];
+  int material_index;
   glm::vec4 face_normal;
   glm::vec4 calculated_face_normal;
   double tex_coords[6];
@@ -38,21 +44,131 @@ typedef struct {
   std::vector<material_t> materials;
   std::vector<unsigned int> color_indices;
 
+  bool has_calculated_normals = false;
+  bool calculated_ccw = true; // orientation used by CalculateNormals
+
+  // triangles of each vertex, built by the parallel CalculateNormals and 
+  // kept while the triangles do not change
+  std::vector<int> vertex_face_offsets;
+  std::vector<int> vertex_faces;
+  size_t vertex_faces_triangle_count = 0;
+
   glm::vec3    bounding_box_min = glm::vec3(0.0f);
   glm::vec3    bounding_box_max = glm::vec3(0.0f);
 } model_t;
 
+// Meshes are shared by the scenes and never modified through this handle.
+// A streamed preview only grows through the loader's own handle: triangles
+// are appended to arrays reserved for the whole model, so the ones a scene 
+// has seen never move, and the scenes are handed the model again to take
+// in the new ones.
+typedef std::shared_ptr<const model_t> model_ref_t;
+
+
+// Triangles added to a model while its file is still being read. Indices 
+// refer to the whole model and the vertices continue the ones from the 
+// previous batch.
+typedef struct {
+  std::string model_name;
+  bool has_texture = false;
+  std::vector<material_t> materials;
+  size_t total_triangles = 0;
+
+  std::vector<model_triangle_t> triangles;
+  std::vector<glm::vec4> vertices;
+  std::vector<unsigned int> color_indices;
+  std::vector<float> raw_normals;
+
+  glm::vec3 bounding_box_min = glm::vec3(0.0f); // of everything read so far
+  glm::vec3 bounding_box_max = glm::vec3(0.0f);
+} model_batch_t;
+
+// Lets another thread follow a load and stop it. Cancelling makes the 
+// reader throw at the next checkpoint. With publish_batches set the reader
+// also hands out the triangles it has merged so far.
+typedef struct {
+  std::atomic<size_t> bytes_done{0};
+  std::atomic<size_t> bytes_total{0};
+  std::atomic<bool>   cancel{false};
+
+  bool publish_batches = false;
+  std::mutex batch_mutex;
+  std::vector<model_batch_t> batches;
+} model_load_progress_t;
+
+// Readers publish a batch about every this many bytes of the file
+#define STREAM_CHUNK_SIZE (4 << 20)
+
+typedef struct {
+  // Vertices closer than this distance are welded into one. With 0 only
+  // bitwise-equal positions are merged, like the original linear search.
+  float weld_epsilon = 0.0f;
+
+  // Large files are split at triangle records and parsed by this many 
+  // threads (0 uses every core). The result does not depend on the count.
+  int thread_count = 1;
+
+  // Keeps a binary copy of the parsed model (with calculated normals) and 
+  // maps it on the next load while the source file stays the same.
+  bool use_mesh_cache = false;
+  std::string cache_dir; // empty writes the cache next to the source file
+  bool ccw_face = true;
+
+  model_load_progress_t *progress = nullptr;
+} model_load_options_t;
+
+typedef struct {
+  int32_t x, y, z;
+} weld_key_t;
+
+struct weld_key_hash_t {
+  size_t operator()(const weld_key_t &k) const;
+};
+
+struct weld_key_equal_t {
+  bool operator()(const weld_key_t &a, const weld_key_t &b) const;
+};
+
+// Spatial hash used to find repeated vertices in O(1) while reading a model.
+// With epsilon == 0 the key is the exact bit pattern of the position, 
+// otherwise it is the grid cell of size epsilon that contains it.
+typedef struct {
+  float epsilon = 0.0f;
+  std::unordered_map<weld_key_t, int, weld_key_hash_t, weld_key_equal_t> cells;
+  std::vector<int> next; // next vertex in the same cell, -1 ends the list
+} vertex_welder_t;
+
+void InitVertexWelder(vertex_welder_t *welder, float epsilon, size_t expected_vertices);
+int  WeldVertex(vertex_welder_t *welder, std::vector<glm::vec4> *vertices, glm::vec4 vertex, bool *is_new);
+
+// Reads a .in model, a Wavefront OBJ (".obj") or a binary PLY (".ply")
+model_t ReadModelFile(const char* filename, model_load_options_t options = model_load_options_t());
+// Vertex normals are the average of the surrounding face normals. With 
+// more than one thread (0 uses every core) each vertex gathers its faces 
+// through the vertex_faces lists, which gives the same result as the 
+// serial scatter. Once *cancel is set the pass throws at the next block.
+void CalculateNormals(model_t *model, bool ccw_face, int thread_count = 1, const std::atomic<bool> *cancel = nullptr);
+material_t DefaultMaterial(); // for formats without materials
 
-model_t ReadModelFile(const char* filename);
-void CalculateNormals(model_t *model, bool ccw_face);
+// Appends a batch to a model that is being streamed in. Calculated normals
+// only account for the triangles appended so far, normal_sums keeps the 
+// unnormalized vertex normals between batches.
+void AppendModelBatch(model_t *model, std::vector<glm::vec4> *normal_sums, const model_batch_t &batch, bool ccw_face);
+// Hands the triangles from first_triangle and the vertices from first_vertex
+// on to progress->batches. total_triangles is the size of the whole model, 
+// which the scenes reserve for when the first batch arrives.
+void PublishModelBatch(model_load_progress_t *progress, const model_t &model, size_t total_triangles, 
+                       size_t first_triangle, size_t first_vertex);
 
 // Because the old code used the vertex list in this format, I added these 
-// functions in order to mantain compatibility
-std::vector<float> ExtractVertices(model_t model);
-std::vector<float> ExtractNormals(model_t model);
-std::vector<float> ExtractCalculatedNormals(model_t model);
-std::vector<float> ExtractSurfaceNormals(model_t model);
-std::vector<float> ExtractCalculatedSurfaceNormals(model_t model);
-std::vector<float> ExtractTextureCoords(model_t model);
+// functions in order to mantain compatibility. They extract triangle_count
+// triangles starting at first_triangle (all of them by default).
+std::vector<float> ExtractVertices(const model_t &model, size_t first_triangle = 0, size_t triangle_count = SIZE_MAX);
+std::vector<float> ExtractNormals(const model_t &model, size_t first_triangle = 0, size_t triangle_count = SIZE_MAX);
+std::vector<float> ExtractCalculatedNormals(const model_t &model, size_t first_triangle = 0, size_t triangle_count = SIZE_MAX);
+std::vector<float> ExtractRawNormals(const model_t &model, size_t first_triangle = 0, size_t triangle_count = SIZE_MAX);
+std::vector<float> ExtractSurfaceNormals(const model_t &model, size_t first_triangle = 0, size_t triangle_count = SIZE_MAX);
+std::vector<float> ExtractCalculatedSurfaceNormals(const model_t &model, size_t first_triangle = 0, size_t triangle_count = SIZE_MAX);
+std::vector<float> ExtractTextureCoords(const model_t &model, size_t first_triangle = 0, size_t triangle_count = SIZE_MAX);
 
 #endif // _MODEL_H
@@ -0,0 +1,25 @@
+#ifndef _MODEL_BENCHMARK_H
+#define _MODEL_BENCHMARK_H
+
+#include "graphics/model.h"
+
+// Readers compared by the benchmark. The two token scans only split the 
+// file into words, so they measure std::ifstream extraction, which the 
+// loader used before the tokenizer, against the tokenizer itself.
+#define MODEL_PARSER_STREAM_TOKENS 0 // std::ifstream >> std::string over every word
+#define MODEL_PARSER_TOKENS        1 // NextWord over the mapped file
+#define MODEL_PARSER_LOADER        2 // ReadModelFile, the whole load
+#define MODEL_PARSER_COUNT         3
+
+// Number of words in a file, read with std::ifstream or with the tokenizer
+size_t CountWordsStream(const char* filename);
+size_t CountWords(const char* filename);
+
+// Writes a .in grid mesh of at least triangle_count triangles
+void WriteSyntheticModelFile(const char* filename, size_t triangle_count);
+
+// MB/s of a parser on one thread and without the mesh cache, best of repeats
+double ModelParserThroughput(int parser, const char* filename, int repeats);
+const char* ModelParserName(int parser);
+
+#endif // _MODEL_BENCHMARK_H
@@ -0,0 +1,51 @@
+#ifndef _MODEL_LOADER_H
+#define _MODEL_LOADER_H
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "graphics/model.h"
+
+enum ModelLoaderState { LOADER_IDLE, LOADER_PARSING, LOADER_NORMALS, LOADER_READY, LOADER_FAILED };
+
+// Reads a model and calculates its normals on a worker thread. The render 
+// thread polls IsReady() and takes the finished model to upload it. When 
+// started as progressive, TakeBatches() returns a preview of the model with 
+// the triangles read so far.
+class ModelLoader
+{
+public:
+  std::string filename;
+  std::string error;
+  double      start_time = 0.0;
+  size_t      total_triangles = 0; // known once the first batch is taken
+
+  ~ModelLoader();
+
+  void  Start(const char* filename, model_load_options_t options, double start_time, bool progressive = false);
+  void  Cancel();
+  bool  IsLoading();
+  bool  IsReady();
+  bool  HasFailed();
+  float Progress();
+  const char* StageName();
+  model_t TakeModel();
+  // The preview grown by the batches read since the last call, empty when
+  // none arrived. It is the same model every time, appended to in place.
+  model_ref_t TakeBatches();
+
+private:
+  std::thread           worker;
+  std::atomic<int>      state{LOADER_IDLE};
+  model_load_progress_t progress;
+  model_t               model;
+  std::shared_ptr<model_t> preview;
+  bool                  ccw_face = true;
+  std::vector<glm::vec4> preview_normal_sums;
+
+  void Run(model_load_options_t options);
+  void Join();
+};
+
+#endif // _MODEL_LOADER_H
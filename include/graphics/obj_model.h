@@ -0,0 +1,19 @@
+#ifndef _OBJ_MODEL_H
+#define _OBJ_MODEL_H
+
+#include <string>
+#include <vector>
+
+#include "graphics/model.h"
+
+// Reads a Wavefront OBJ mesh and the MTL libraries it names. Positions are
+// shared between faces through the welder, texture coordinates and normals
+// are kept per corner like in the .in format. Polygons are split in fans.
+model_t ParseObjFile(const char* filename, const char* data, size_t size, model_load_options_t options);
+
+// Paths of the material libraries named by "mtllib" lines
+std::vector<std::string> ObjMaterialLibraries(const char* filename, const char* data, size_t size);
+
+bool IsObjFile(const char* filename);
+
+#endif // _OBJ_MODEL_H
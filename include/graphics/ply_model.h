@@ -0,0 +1,14 @@
+#ifndef _PLY_MODEL_H
+#define _PLY_MODEL_H
+
+#include "graphics/model.h"
+
+// Reads a binary little endian PLY mesh. Only the header is parsed, the
+// vertex and face elements are copied straight out of the mapped file. The
+// vertices of a PLY are already shared, so they are only welded when
+// options.weld_epsilon is above zero.
+model_t ParsePlyFile(const char* filename, const char* data, size_t size, model_load_options_t options);
+
+bool IsPlyFile(const char* filename);
+
+#endif // _PLY_MODEL_H
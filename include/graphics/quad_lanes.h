@@ -0,0 +1,129 @@
+#ifndef _QUAD_LANES_H
+#define _QUAD_LANES_H
+
+#include <cmath>
+#include <glm/vec4.hpp>
+
+// Close2GL shades fragments in 2x2 quads with one SIMD lane per pixel:
+//   lane 0 (x, y)      lane 1 (x + 1, y)
+//   lane 2 (x, y + 1)  lane 3 (x + 1, y + 1)
+#define QUAD_LANES 4
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define QUAD_LANES_SSE2
+#include <emmintrin.h>
+typedef __m128 lane_t;
+#else
+typedef struct
+{
+  float v[QUAD_LANES];
+} lane_t;
+#endif
+
+// A vec4 per lane, one register per component
+typedef struct
+{
+  lane_t x, y, z, w;
+} quad_vec4_t;
+
+#ifdef QUAD_LANES_SSE2
+
+inline lane_t LaneSet(float a)                { return _mm_set1_ps(a); }
+inline lane_t LaneLoad(const float *p)        { return _mm_loadu_ps(p); }
+inline void   LaneStore(float *p, lane_t a)   { _mm_storeu_ps(p, a); }
+inline lane_t LaneAdd(lane_t a, lane_t b)     { return _mm_add_ps(a, b); }
+inline lane_t LaneSub(lane_t a, lane_t b)     { return _mm_sub_ps(a, b); }
+inline lane_t LaneMul(lane_t a, lane_t b)     { return _mm_mul_ps(a, b); }
+inline lane_t LaneDiv(lane_t a, lane_t b)     { return _mm_div_ps(a, b); }
+inline lane_t LaneMax(lane_t a, lane_t b)     { return _mm_max_ps(a, b); }
+inline lane_t LaneSqrt(lane_t a)              { return _mm_sqrt_ps(a); }
+
+#else
+
+#define LANE_OP(expression) \
+  lane_t r; \
+  for (int i = 0; i < QUAD_LANES; i++) \
+    r.v[i] = expression; \
+  return r;
+
+inline lane_t LaneSet(float a)                { LANE_OP(a) }
+inline lane_t LaneLoad(const float *p)        { LANE_OP(p[i]) }
+inline void   LaneStore(float *p, lane_t a)   { for (int i = 0; i < QUAD_LANES; i++) p[i] = a.v[i]; }
+inline lane_t LaneAdd(lane_t a, lane_t b)     { LANE_OP(a.v[i] + b.v[i]) }
+inline lane_t LaneSub(lane_t a, lane_t b)     { LANE_OP(a.v[i] - b.v[i]) }
+inline lane_t LaneMul(lane_t a, lane_t b)     { LANE_OP(a.v[i] * b.v[i]) }
+inline lane_t LaneDiv(lane_t a, lane_t b)     { LANE_OP(a.v[i] / b.v[i]) }
+inline lane_t LaneMax(lane_t a, lane_t b)     { LANE_OP(a.v[i] < b.v[i] ? b.v[i] : a.v[i]) }
+inline lane_t LaneSqrt(lane_t a)              { LANE_OP(std::sqrt(a.v[i])) }
+
+#undef LANE_OP
+
+#endif // QUAD_LANES_SSE2
+
+// No vector pow, each lane goes through std::pow
+inline lane_t LanePow(lane_t a, float exponent)
+{
+  float v[QUAD_LANES];
+  LaneStore(v, a);
+  for (int i = 0; i < QUAD_LANES; i++)
+    v[i] = std::pow(v[i], exponent);
+  return LaneLoad(v);
+}
+
+// w0 * a + w1 * b + w2 * c in every lane
+inline lane_t LaneInterpolate(lane_t w0, lane_t w1, lane_t w2, float a, float b, float c)
+{
+  return LaneAdd(LaneAdd(LaneMul(w0, LaneSet(a)), LaneMul(w1, LaneSet(b))), LaneMul(w2, LaneSet(c)));
+}
+
+inline quad_vec4_t QuadSet(glm::vec4 v)
+{
+  return { LaneSet(v.x), LaneSet(v.y), LaneSet(v.z), LaneSet(v.w) };
+}
+
+inline quad_vec4_t QuadInterpolate(lane_t w0, lane_t w1, lane_t w2, glm::vec4 a, glm::vec4 b, glm::vec4 c)
+{
+  return {
+    LaneInterpolate(w0, w1, w2, a.x, b.x, c.x),
+    LaneInterpolate(w0, w1, w2, a.y, b.y, c.y),
+    LaneInterpolate(w0, w1, w2, a.z, b.z, c.z),
+    LaneInterpolate(w0, w1, w2, a.w, b.w, c.w) };
+}
+
+inline quad_vec4_t QuadAdd(quad_vec4_t a, quad_vec4_t b)
+{
+  return { LaneAdd(a.x, b.x), LaneAdd(a.y, b.y), LaneAdd(a.z, b.z), LaneAdd(a.w, b.w) };
+}
+
+inline quad_vec4_t QuadSub(quad_vec4_t a, quad_vec4_t b)
+{
+  return { LaneSub(a.x, b.x), LaneSub(a.y, b.y), LaneSub(a.z, b.z), LaneSub(a.w, b.w) };
+}
+
+inline quad_vec4_t QuadMul(quad_vec4_t a, quad_vec4_t b)
+{
+  return { LaneMul(a.x, b.x), LaneMul(a.y, b.y), LaneMul(a.z, b.z), LaneMul(a.w, b.w) };
+}
+
+inline quad_vec4_t QuadScale(quad_vec4_t a, lane_t s)
+{
+  return { LaneMul(a.x, s), LaneMul(a.y, s), LaneMul(a.z, s), LaneMul(a.w, s) };
+}
+
+inline quad_vec4_t QuadDivide(quad_vec4_t a, lane_t s)
+{
+  return { LaneDiv(a.x, s), LaneDiv(a.y, s), LaneDiv(a.z, s), LaneDiv(a.w, s) };
+}
+
+inline lane_t QuadDot(quad_vec4_t a, quad_vec4_t b)
+{
+  return LaneAdd(LaneAdd(LaneMul(a.x, b.x), LaneMul(a.y, b.y)), LaneAdd(LaneMul(a.z, b.z), LaneMul(a.w, b.w)));
+}
+
+// Same as glm::normalize, v * (1 / sqrt(dot(v, v)))
+inline quad_vec4_t QuadNormalize(quad_vec4_t v)
+{
+  return QuadScale(v, LaneDiv(LaneSet(1.0f), LaneSqrt(QuadDot(v, v))));
+}
+
+#endif // _QUAD_LANES_H
@@ -0,0 +1,111 @@
+#ifndef _TOKENIZER_H
+#define _TOKENIZER_H
+
+#include <charconv>
+#include <stdexcept>
+#include <string_view>
+
+// Walks a text buffer (usually a mapped file) without copying it. Words are
+// separated by any whitespace, like std::istream extraction.
+typedef struct {
+  const char *current;
+  const char *end;
+} tokenizer_t;
+
+inline bool IsSpace(char c)
+{
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f';
+}
+
+inline void SkipSpaces(tokenizer_t *tk)
+{
+  while (tk->current < tk->end && IsSpace(*tk->current))
+    tk->current++;
+}
+
+// Moves to the first character after the next line break
+inline void SkipLine(tokenizer_t *tk)
+{
+  while (tk->current < tk->end && *tk->current != '\n')
+    tk->current++;
+  if (tk->current < tk->end)
+    tk->current++;
+}
+
+// Skips spaces and tabs, stopping at the line break
+inline void SkipBlanks(tokenizer_t *tk)
+{
+  while (tk->current < tk->end && IsSpace(*tk->current) && *tk->current != '\n')
+    tk->current++;
+}
+
+// True when only blanks or a '#' comment are left on the current line
+inline bool AtLineEnd(tokenizer_t *tk)
+{
+  SkipBlanks(tk);
+  return tk->current >= tk->end || *tk->current == '\n' || *tk->current == '#';
+}
+
+// The rest of the line without surrounding blanks, for names with spaces
+inline std::string_view RestOfLine(tokenizer_t *tk)
+{
+  SkipBlanks(tk);
+  const char *begin = tk->current;
+  while (tk->current < tk->end && *tk->current != '\n')
+    tk->current++;
+  const char *last = tk->current;
+  while (last > begin && IsSpace(last[-1]))
+    last--;
+  return std::string_view(begin, last - begin);
+}
+
+inline bool AtEnd(tokenizer_t *tk)
+{
+  SkipSpaces(tk);
+  return tk->current >= tk->end;
+}
+
+inline std::string_view NextWord(tokenizer_t *tk)
+{
+  SkipSpaces(tk);
+  const char *begin = tk->current;
+  while (tk->current < tk->end && !IsSpace(*tk->current))
+    tk->current++;
+  if (begin == tk->current)
+    throw std::runtime_error("Unexpected end of file");
+  return std::string_view(begin, tk->current - begin);
+}
+
+inline void SkipWords(tokenizer_t *tk, int count)
+{
+  for (int i = 0; i < count; i++)
+    NextWord(tk);
+}
+
+inline float NextFloat(tokenizer_t *tk)
+{
+  SkipSpaces(tk);
+  if (tk->current < tk->end && *tk->current == '+') // from_chars rejects '+'
+    tk->current++;
+  float value;
+  std::from_chars_result result = std::from_chars(tk->current, tk->end, value);
+  if (result.ec != std::errc())
+    throw std::runtime_error("Malformed number");
+  tk->current = result.ptr;
+  return value;
+}
+
+inline int NextInt(tokenizer_t *tk)
+{
+  SkipSpaces(tk);
+  if (tk->current < tk->end && *tk->current == '+')
+    tk->current++;
+  int value;
+  std::from_chars_result result = std::from_chars(tk->current, tk->end, value);
+  if (result.ec != std::errc())
+    throw std::runtime_error("Malformed number");
+  tk->current = result.ptr;
+  return value;
+}
+
+#endif // _TOKENIZER_H
@@ -0,0 +1,82 @@
+#ifndef _VERTEX_KERNELS_H
+#define _VERTEX_KERNELS_H
+
+#include <glm/mat4x4.hpp>
+#include <glm/vec4.hpp>
+#include <vector>
+
+// Instruction sets of the vertex kernels, picked at runtime
+#define VERTEX_ISA_SCALAR 0
+#define VERTEX_ISA_SSE2   1
+#define VERTEX_ISA_AVX2   2
+#define VERTEX_ISA_AVX512 3
+#define VERTEX_ISA_COUNT  4
+
+// Clip space outcodes, one bit per frustum plane the vertex is outside of
+#define CLIP_LEFT   1
+#define CLIP_RIGHT  2
+#define CLIP_BOTTOM 4
+#define CLIP_TOP    8
+#define CLIP_NEAR   16
+#define CLIP_FAR    32
+#define CLIP_GUARD_BAND 64 // outside the guard band around the side planes
+
+#define CLIP_FRUSTUM   (CLIP_LEFT | CLIP_RIGHT | CLIP_BOTTOM | CLIP_TOP | CLIP_NEAR | CLIP_FAR)
+#define CLIP_GEOMETRIC (CLIP_NEAR | CLIP_FAR | CLIP_GUARD_BAND)
+
+// One array per component, so a kernel loads 4, 8 or 16 consecutive
+// vertices with a single instruction per component
+typedef struct
+{
+  std::vector<float> x, y, z, w;
+} vec4_soa_t;
+
+typedef struct
+{
+  glm::mat4 mvp;
+  glm::mat4 viewport;
+  glm::mat4 inverse_projection;
+  glm::mat4 model_view;
+  float guard_band;
+} vertex_transform_t;
+
+// Outputs of the vertex stage, one entry per vertex
+typedef struct
+{
+  vec4_soa_t clip_positions;   // Homogeneous Clipping Space
+  vec4_soa_t screen_positions; // Viewport
+  vec4_soa_t ccs_positions;    // divided by w, ready to interpolate
+  vec4_soa_t ccs_normals;      // divided by w, ready to interpolate
+  std::vector<float> ww;
+  std::vector<unsigned char> outcodes;
+} transformed_vertices_t;
+
+void ResizeSoa(vec4_soa_t *soa, size_t count);
+void ResizeTransformedVertices(transformed_vertices_t *vertices, size_t count);
+
+inline glm::vec4 SoaAt(const vec4_soa_t &soa, size_t i)
+{
+  return glm::vec4(soa.x[i], soa.y[i], soa.z[i], soa.w[i]);
+}
+
+inline void SoaSet(vec4_soa_t *soa, size_t i, glm::vec4 v)
+{
+  soa->x[i] = v.x; soa->y[i] = v.y; soa->z[i] = v.z; soa->w[i] = v.w;
+}
+
+bool VertexIsaSupported(int isa);
+int BestVertexIsa();
+const char* VertexIsaName(int isa);
+
+unsigned char ClipOutcode(glm::vec4 v, float guard_band);
+
+// Transforms the vertices in [first, last) of positions and normals, which
+// must have the same size as the already resized output. Falls back to the
+// scalar kernel when the CPU does not support isa.
+void TransformVertices(int isa, const vertex_transform_t &transform, const vec4_soa_t &positions, const vec4_soa_t &normals,
+                       size_t first, size_t last, transformed_vertices_t *out);
+
+// Vertices per second of an isa on vertex_count random vertices
+double VertexKernelThroughput(int isa, size_t vertex_count, int repeats);
+
+#endif // _VERTEX_KERNELS_H
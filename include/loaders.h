@@ -5,6 +5,22 @@
 #include <sstream>
 #include <fstream>
 
+typedef struct {
+  const char *data = nullptr;
+  size_t size = 0;
+#ifdef _WIN32
+  void *file_handle = nullptr;
+  void *mapping_handle = nullptr;
+#endif
+} mapped_file_t;
+
 std::string ReadFileContent(const char* filename);
 
+// Case insensitive, extension includes the dot
+bool HasExtension(const char* filename, const char* extension);
+
+// Maps the whole file read-only into memory, throws if it cannot be opened
+mapped_file_t MapFile(const char* filename);
+void UnmapFile(mapped_file_t *file);
+
 #endif // _LOADERS_H
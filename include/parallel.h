@@ -0,0 +1,17 @@
+#ifndef _PARALLEL_H
+#define _PARALLEL_H
+
+#include <functional>
+
+// Number of threads the machine can run at once (at least 1)
+int HardwareThreadCount();
+
+// Runs task(index, thread) for every index in [0, count) using up to 
+// thread_count threads (0 uses every hardware thread). Indices are handed 
+// out in increasing order as threads become free. The first exception 
+// thrown by a task is rethrown on the calling thread. The threads are kept 
+// in a pool between calls; a call made while the pool is busy starts its 
+// own threads.
+void ParallelFor(size_t count, int thread_count, const std::function<void(size_t index, int thread)> &task);
+
+#endif // _PARALLEL_H
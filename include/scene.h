@@ -7,12 +7,27 @@
 #include <glm/vec3.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <algorithm>
+#include <any>
+#include <cstdint>
 #include <map>
 
 #include "matrices.h"
 #include "graphics/model.h"
 #include "graphics/texture.h"
 #include "graphics/gpu_program.h"
+#include "graphics/vertex_kernels.h"
+#include "graphics/quad_lanes.h"
+
+// Close2GL triangle rasterizers. The half-space one only fills, points and
+// wireframes always go through the scanline walker.
+#define RASTERIZER_SCANLINE   0
+#define RASTERIZER_HALF_SPACE 1
+#define RASTER_SUBPIXEL_BITS  8
+#define HALF_SPACE_BLOCK      8 // pixels per side of the blocks tested as a whole
+
+// Texture part of the Close2GL pipeline key, the other values are the
+// texture filters of textured draws
+#define PIPELINE_UNTEXTURED 0
 
 typedef struct
 {
@@ -30,6 +45,14 @@ typedef struct
   int   texture_filter = GL_NEAREST;
   int   filter_level = 0;
 
+  int   vertex_isa = BestVertexIsa();
+  int   raster_threads = 0; // 0 uses every hardware thread
+  int   rasterizer = RASTERIZER_SCANLINE;
+  bool  early_z = true; // depth test fragments before shading them
+  bool  visibility_buffer = false; // rasterize first, then shade every visible pixel once
+  bool  sort_clusters = false; // submit triangle clusters front to back
+  float guard_band = 4.0f; // Close2GL side clip planes are at x, y = +-guard_band * w
+
   float gui_object_color[4] = {0.0f, 0.0f, 0.0f, 1.0f};
 
   bool debug_colors = false;
@@ -45,6 +68,30 @@ typedef struct
 
 const rgba_t black = { 0.0, 0.0, 0.0, 1.0 };
 
+// A triangle clipped by the six planes has at most nine vertices
+#define CLIP_MAX_VERTICES 9
+
+// Close2GL rasterizes the screen in square tiles that threads take in turn
+#define TILE_SIZE 64
+#define RASTER_BLOCK_SIZE 256 // triangles per vertex setup task
+#define RASTER_MARGIN 2.0f    // pixels a fragment may land outside its triangle bounds
+
+// What the first pass of visibility buffer shading keeps of a pixel
+#define VISIBILITY_EMPTY 0xFFFFFFFFu
+typedef struct
+{
+  unsigned int triangle; // index in triangles, or VISIBILITY_EMPTY
+  float weights[3];      // barycentric weights of the triangle vertices
+} visibility_sample_t;
+
+// Pixels [x0, x1) x [y0, y1) of a tile
+typedef struct
+{
+  int x0, y0, x1, y1;
+} tile_rect_t;
+
+// Attributes the vertex setup writes for each triangle vertex. All but
+// the flat ones are multiplied by ww, ready to interpolate.
 typedef struct
 {
   glm::vec4 ccs_position;
@@ -53,17 +100,182 @@ typedef struct
   glm::vec2 texture_coords;
   float ww = 1.0;
 
-  glm::vec4 vColorAmbient;
-  glm::vec4 vColorDiffuse;
-  glm::vec4 vColorSpecular;
+  glm::vec4 flatColor;
+  glm::vec4 flatCcsNormal;
+} vertex_attr_t;
+
+// Varyings of a Close2GL layout, the attributes its fragments read. The
+// flat ones take the highest bits and are copied from one end of a span
+// instead of interpolated.
+#define VARYING_COLOR          1
+#define VARYING_CCS_POSITION   2
+#define VARYING_CCS_NORMAL     4
+#define VARYING_TEXTURE_COORDS 8
+#define VARYING_GOURAUD_TERMS  16 // ambient, diffuse and specular terms of the vertices
+#define VARYING_FLAT_COLOR     32
+#define VARYING_FLAT_NORMAL    64
+#define VARYING_FLAT_TERMS     128 // ambient, diffuse and specular terms of the face
+#define VARYING_END            256
+
+constexpr int VaryingFloats(int varying)
+{
+  switch (varying)
+  {
+    case VARYING_TEXTURE_COORDS:
+      return 2;
+    case VARYING_GOURAUD_TERMS:
+    case VARYING_FLAT_TERMS:
+      return 12;
+    default:
+      return 4;
+  }
+}
+
+// Position of a varying in the floats of a layout, after the varyings of
+// the lower bits
+constexpr int VaryingOffset(int layout, int varying)
+{
+  int offset = 0;
+  for (int bit = 1; bit < varying; bit <<= 1)
+    if (layout & bit)
+      offset += VaryingFloats(bit);
+  return offset;
+}
 
-  glm::vec4 flatColorAmbient;
-  glm::vec4 flatColorDiffuse;
-  glm::vec4 flatColorSpecular;
+// Varyings the fragments of a pipeline key read. Textured fragments 
+// without a level of detail fall back to the untextured path, so those
+// layouts keep its varyings too.
+constexpr int VaryingsLayout(int shading, int lighting, int texture)
+{
+  bool lit = (lighting & (DIFFUSE_LIGHT | SPECULAR_LIGHT)) != 0;
+  int layout = 0;
+  switch (shading)
+  {
+    case FLAT_SHADING:
+      layout = VARYING_FLAT_COLOR;
+      break;
+    case PHONG_SHADING:
+      layout = VARYING_COLOR | (lit ? VARYING_CCS_POSITION | VARYING_CCS_NORMAL : 0);
+      break;
+    case FLAT_PHONG_SHADING:
+      layout = VARYING_COLOR | (lit ? VARYING_CCS_POSITION | VARYING_FLAT_NORMAL : 0);
+      break;
+    default:
+      layout = VARYING_COLOR;
+  }
 
-  glm::vec4 flatColor; // this attribute is not being interpolated
-  glm::vec4 flatCcsNormal; // this attribute is not being interpolated
-} interpolating_attr_t;
+  if (texture == PIPELINE_UNTEXTURED)
+    return layout;
+  layout |= VARYING_TEXTURE_COORDS;
+  if (shading == FLAT_SHADING)
+    layout |= VARYING_FLAT_TERMS;
+  if (shading == GOURAUD_SHADING)
+    layout |= VARYING_GOURAUD_TERMS;
+  return layout;
+}
+
+// Packed varyings of one vertex or fragment. Every layout reads a color,
+// so v is never empty.
+template <int LAYOUT>
+struct varyings_t
+{
+  static constexpr int SIZE = VaryingOffset(LAYOUT, VARYING_END);
+  static constexpr int INTERPOLATED = VaryingOffset(LAYOUT, VARYING_FLAT_COLOR);
+  float ww;
+  float v[SIZE]; // the varyings of LAYOUT in bit order
+};
+
+template <int SHADING, int LIGHTING, int TEXTURE>
+using pipeline_varyings_t = varyings_t<VaryingsLayout(SHADING, LIGHTING, TEXTURE)>;
+
+// Varyings the layout leaves out read as zero and drop what is written to
+// them, so code shared by the layouts needs no checks. term picks one of
+// the three vec4 of the lighting terms.
+template <int VARYING, int LAYOUT>
+glm::vec4 Varying(const varyings_t<LAYOUT> &attr, int term = 0)
+{
+  if constexpr ((LAYOUT & VARYING) == 0)
+    return glm::vec4(0.0f);
+  else {
+    const float *v = &attr.v[VaryingOffset(LAYOUT, VARYING) + 4 * term];
+    return glm::vec4(v[0], v[1], v[2], v[3]);
+  }
+}
+
+template <int VARYING, int LAYOUT>
+void SetVarying(varyings_t<LAYOUT> *attr, glm::vec4 value, int term = 0)
+{
+  if constexpr ((LAYOUT & VARYING) != 0) {
+    float *v = &attr->v[VaryingOffset(LAYOUT, VARYING) + 4 * term];
+    v[0] = value.x;
+    v[1] = value.y;
+    v[2] = value.z;
+    v[3] = value.w;
+  }
+}
+
+template <int LAYOUT>
+glm::vec2 TextureCoords(const varyings_t<LAYOUT> &attr)
+{
+  if constexpr ((LAYOUT & VARYING_TEXTURE_COORDS) == 0)
+    return glm::vec2(0.0f);
+  else {
+    const float *v = &attr.v[VaryingOffset(LAYOUT, VARYING_TEXTURE_COORDS)];
+    return glm::vec2(v[0], v[1]);
+  }
+}
+
+template <int LAYOUT>
+void SetTextureCoords(varyings_t<LAYOUT> *attr, glm::vec2 value)
+{
+  if constexpr ((LAYOUT & VARYING_TEXTURE_COORDS) != 0) {
+    float *v = &attr->v[VaryingOffset(LAYOUT, VARYING_TEXTURE_COORDS)];
+    v[0] = value.x;
+    v[1] = value.y;
+  }
+}
+
+// Post-transform vertex cache of Close2GL, one entry per model vertex. The 
+// model space copies are only gathered again when the model or the normals
+// in use change.
+typedef struct
+{
+  vec4_soa_t positions;
+  vec4_soa_t normals;
+  transformed_vertices_t transformed;
+
+  const model_t *source = nullptr;
+  size_t source_vertices = 0;
+  int    normal_source = -1;
+  float  normal_sign = 0.0f;
+} vertex_cache_t;
+
+// Close2GL submits the triangles in clusters sorted front to back, so more
+// fragments fail the early depth test
+#define CLUSTER_SIZE 64
+#define CLUSTER_REORDER_DISTANCE 0.01f // of the model size the eye may move before sorting again
+#define CLUSTER_REORDER_COS 0.9998f    // about one degree of turning
+
+typedef struct
+{
+  std::vector<glm::vec4> centroids; // model space, one per cluster
+  std::vector<unsigned int> order;  // cluster indices, nearest first
+  std::vector<unsigned int> scratch;
+  std::vector<float> depths;        // kept so sorting again does not allocate
+  std::vector<unsigned short> keys;
+
+  const model_t *source = nullptr;
+  glm::vec3 eye, forward; // model space camera of the last sort
+  bool valid = false;
+} cluster_order_t;
+
+typedef struct
+{
+  glm::vec4 position; // Homogeneous Clipping Space
+  glm::vec4 normal;
+  glm::vec4 color;
+  glm::vec2 texture_coords;
+} clip_vertex_t;
 
 typedef struct
 {
@@ -71,21 +283,23 @@ typedef struct
   glm::vec4 mapped_vertices[3]; // Viewport
   glm::vec4 normals[3];
   glm::vec4 face_normal;
-  interpolating_attr_t attrs[3];
+  vertex_attr_t attrs[3];
 } triangle_t;
 
-typedef struct
+template <int LAYOUT>
+struct edge_t
 {
   glm::vec4 vertex_top;
   glm::vec4 vertex_bottom;
   glm::vec4 vertex_delta;
   float inc_x, inc_z;
   float min_x, max_x;
-  interpolating_attr_t top;
-  interpolating_attr_t bottom;
-} edge_t;
+  varyings_t<LAYOUT> top;
+  varyings_t<LAYOUT> bottom;
+};
 
-typedef edge_t scanline_t;
+template <int LAYOUT>
+using scanline_t = edge_t<LAYOUT>;
 
 class SuperScene
 {
@@ -112,10 +326,16 @@ public:
   GLuint vbo_model_id;
   GLuint vbo_normal_id;
   GLuint vbo_surface_normal_id;
-  GLuint vbo_texture_coords_id;
+  GLuint vbo_texture_coords_id = 0;
   GLuint texture_id = 0;
+  bool   has_texture = false;
+  bool   calculated_ccw = true; // orientation of the uploaded calculated normals
+
+  model_ref_t model;
 
-  void LoadModelToScene(scene_state_t state, model_t model);
+  void LoadModelToScene(scene_state_t state, model_ref_t model);
+  void ReserveModelInScene(scene_state_t state, model_ref_t model, size_t triangle_count);
+  void AppendModelToScene(scene_state_t state, model_ref_t model, size_t first_triangle);
   void LoadTextureToScene(scene_state_t state, texture_t tex);
   void Enable(scene_state_t state);
   void Render(scene_state_t state, glm::mat4 view_matrix, glm::mat4 projection_matrix);
@@ -130,51 +350,96 @@ public:
   GLuint vbo_texture_coords_id;
   GLuint texture_id;
   
-  model_t model;
+  model_ref_t model;
   std::vector<triangle_t> triangles;
+  vertex_cache_t vertex_cache;
+  cluster_order_t cluster_order;
+
+  // per frame
+  glm::mat4 model_view_matrix;
+  glm::mat4 inverse_projection_matrix;
+  glm::mat4 viewport_matrix;
 
   int buffer_size;
   rgba_t *color_buffer;
   float  *depth_buffer;
 
   texture_t *mipmaps;
-  glm::vec2 delta_tex;
+
+  std::vector<std::vector<unsigned int>> tile_bins; // triangles of each tile, in order
+  int tile_columns = 0, tile_rows = 0;
+  std::vector<visibility_sample_t> visibility; // one sample per pixel
+  std::any triangle_varyings; // vector of the varyings_t of every triangle vertex, in the layout of the last draw
 
   void LoadTrianglesToScene();
   void Enable(scene_state_t state);
   void Render(scene_state_t state, glm::mat4 view_matrix, glm::mat4 projection_matrix);
   void New_Frame();
-  void SetModel(model_t model);
+  void SetModel(model_ref_t model);
   void SetMipmap(texture_t *mipmaps);
   void ResizeBuffers(scene_state_t state);
+  double RasterTime(scene_state_t state, glm::mat4 view_matrix, glm::mat4 projection_matrix, int frames);
 
 private:
   void TransformModel(scene_state_t state, glm::mat4 view_matrix, glm::mat4 projection_matrix, glm::mat4 viewport_matrix);
-  void Rasterize(scene_state_t state, glm::mat4 view_matrix, glm::mat4 projection_matrix, glm::mat4 viewport_matrix);
-  void RasterScanline(scene_state_t state, scanline_t line, glm::mat4 view_matrix);
-  void ChangeBuffer(scene_state_t state, int x, int y, float z, rgba_t color);
-  glm::vec4 ProcessFragment(scene_state_t state, interpolating_attr_t *attr, int x, int y, interpolating_attr_t flatAttr);
-  glm::vec4 GetTextureColor(scene_state_t state, glm::vec2 texture_coord, glm::vec2 delta_tex);
+  void TransformVertices(scene_state_t state, glm::mat4 mvp);
+  void GatherVertices(scene_state_t state);
+  void SetupModelTriangle(scene_state_t state, const model_triangle_t &model_triangle, glm::vec4 color, float normal_sign);
+  void SortClusters();
+  void SetupCachedTriangle(scene_state_t state, const model_triangle_t &model_triangle, glm::vec4 *colors, glm::vec4 face_normal);
+  void SetupTriangle(scene_state_t state, clip_vertex_t *corners, glm::vec4 face_normal);
+  void Rasterize(const scene_state_t &state);
+  void BinTriangles(const scene_state_t &state);
+
+  // The vertex, raster and fragment stages are instantiated once per 
+  // pipeline key: a shading mode, a lighting mode and PIPELINE_UNTEXTURED 
+  // or a texture filter
+  void RasterTiles(const scene_state_t &state);
+  template <int SHADING> void RasterTiles(const scene_state_t &state);
+  template <int SHADING, int LIGHTING> void RasterTiles(const scene_state_t &state);
+  template <int SHADING, int LIGHTING, int TEXTURE> void RasterTiles(const scene_state_t &state);
+  template <int SHADING, int LIGHTING, int TEXTURE> void ShadeVertices(const triangle_t &t, pipeline_varyings_t<SHADING, LIGHTING, TEXTURE> *attrs);
+  template <int SHADING, int LIGHTING, int TEXTURE> void RasterTriangle(const scene_state_t &state, const triangle_t &t, const pipeline_varyings_t<SHADING, LIGHTING, TEXTURE> *attrs, tile_rect_t rect);
+  template <int SHADING, int LIGHTING, int TEXTURE> void RasterTriangleHalfSpace(const scene_state_t &state, unsigned int index, const pipeline_varyings_t<SHADING, LIGHTING, TEXTURE> *attrs, tile_rect_t rect);
+  template <int SHADING, int LIGHTING, int TEXTURE> void ResolveVisibility(const scene_state_t &state, const pipeline_varyings_t<SHADING, LIGHTING, TEXTURE> *varyings, tile_rect_t rect);
+  template <int SHADING, int LIGHTING, int TEXTURE> void ShadeQuad(const scene_state_t &state, const pipeline_varyings_t<SHADING, LIGHTING, TEXTURE> *attrs, const float weights[3][QUAD_LANES], int mask, rgba_t *pixels);
+  template <int SHADING, int LIGHTING, int TEXTURE> void RasterScanline(const scene_state_t &state, const scanline_t<VaryingsLayout(SHADING, LIGHTING, TEXTURE)> &line, tile_rect_t rect, glm::vec2 delta_tex);
+  template <int SHADING, int LIGHTING, int TEXTURE> glm::vec4 ProcessFragment(const scene_state_t &state, pipeline_varyings_t<SHADING, LIGHTING, TEXTURE> *attr, const pipeline_varyings_t<SHADING, LIGHTING, TEXTURE> &flatAttr, glm::vec2 delta_tex);
+  template <int TEXTURE> glm::vec4 GetTextureColor(const scene_state_t &state, glm::vec2 texture_coord, glm::vec2 delta_tex);
+
+  int  PixelIndex(const scene_state_t &state, int x, int y);
+  bool DepthTest(const scene_state_t &state, int x, int y, float z);
+  void ChangeVisibility(const scene_state_t &state, int x, int y, float z, visibility_sample_t sample);
+  void ChangeBuffer(const scene_state_t &state, int x, int y, float z, rgba_t color);
   glm::vec4 Nearest(glm::vec2 texture_coord, int level);
   glm::vec4 Bilinear(glm::vec2 texture_coord, int level);
   glm::vec4 Trilinear(glm::vec2 texture_coord, glm::vec2 delta_tex);
 };
 
 rgba_t vec4_to_rgba(glm::vec4 vec);
-void EraseTriangleWithVertex(std::vector<model_triangle_t> *triangles, int index);
+float ClipDistance(glm::vec4 v, int plane, float guard_band);
+clip_vertex_t ClipLerp(clip_vertex_t a, clip_vertex_t b, float t);
+int ClipPolygon(clip_vertex_t *polygon, int count, unsigned char planes, float guard_band);
+bool InsideScreen(const scene_state_t &state, int x, int y);
+bool InsideRect(tile_rect_t rect, int x, int y);
+void BarycentricGradients(const glm::vec4 *v, glm::vec3 *dx, glm::vec3 *dy);
+float NormalSign(scene_state_t state, bool calculated_ccw);
 bool FaceCulling(glm::vec4 *vertices, int face_orientation);
-edge_t FindEdge(glm::vec4 v0, interpolating_attr_t v0_attr, glm::vec4 v1, interpolating_attr_t v1_attr);
-scanline_t FindScanline(glm::vec4 v0, interpolating_attr_t v0_attr, glm::vec4 v1, interpolating_attr_t v1_attr);
-edge_t* OrderEdges(edge_t* edges);
-interpolating_attr_t Interpolate(interpolating_attr_t attr_0, interpolating_attr_t attr_1, float min, float max, float value);
+template <int LAYOUT> edge_t<LAYOUT> FindEdge(glm::vec4 v0, const varyings_t<LAYOUT> &v0_attr, glm::vec4 v1, const varyings_t<LAYOUT> &v1_attr);
+template <int LAYOUT> scanline_t<LAYOUT> FindScanline(glm::vec4 v0, const varyings_t<LAYOUT> &v0_attr, glm::vec4 v1, const varyings_t<LAYOUT> &v1_attr);
+template <int LAYOUT> void OrderEdges(const edge_t<LAYOUT> *edges, edge_t<LAYOUT> *ordered);
+int PipelineLighting(const scene_state_t &state);
+int PipelineTexture(const scene_state_t &state, bool has_texture);
+template <int LAYOUT> varyings_t<LAYOUT> Interpolate(const varyings_t<LAYOUT> &attr_0, const varyings_t<LAYOUT> &attr_1, float min, float max, float value);
 glm::vec4 AmbientLighting(glm::vec4 color);
 glm::vec4 DiffuseLighting(glm::vec4 color, glm::vec4 ccs_normal, glm::vec4 ccs_position);
 glm::vec4 SpecularLighting(glm::vec4 ccs_normal, glm::vec4 ccs_position);
-glm::vec4 Lighting(scene_state_t state, interpolating_attr_t attr, glm::vec4 normal);
-glm::vec4 LightingWithTextureMapping(scene_state_t state, interpolating_attr_t attr, glm::vec4 color, glm::vec4 normal);
-void Shading(scene_state_t state, interpolating_attr_t *attr);
+template <int LIGHTING> glm::vec4 Lighting(glm::vec4 color, glm::vec4 normal, glm::vec4 ccs_position);
+template <int LIGHTING> quad_vec4_t QuadLighting(quad_vec4_t color, quad_vec4_t normal, quad_vec4_t ccs_position);
+template <int SHADING, int LIGHTING> void Shading(vertex_attr_t *attr);
+template <int SHADING, int LIGHTING, int LAYOUT> void Shading(varyings_t<LAYOUT> *attr);
 
 void PrintTriangle(triangle_t t);
-void PrintEdge(edge_t e);
+template <int LAYOUT> void PrintEdge(const edge_t<LAYOUT> &e);
 
 #endif // _SCENE_H
@@ -12,6 +12,7 @@ uniform vec4 color;
 uniform int shading_mode;
 uniform int lighting_mode;
 uniform bool has_texture;
+uniform float normal_sign; // -1 when the normals were calculated for the other orientation
 
 out vec4 world_position;
 out vec4 normal;
@@ -69,7 +70,7 @@ vec4 specular_light(vec4 normal) {
 
 void flat_shading_with_texture_mapping() {
   int lighting = lighting_mode;
-  vec4 normal = inverse(transpose(model)) * surface_normal_coefficients;
+  vec4 normal = inverse(transpose(model)) * (normal_sign * surface_normal_coefficients);
   normal.w = 0.0;
 
   vec4 specular_term = vec4(0.0);
@@ -97,7 +98,7 @@ void flat_shading_with_texture_mapping() {
 
 void gouraud_shading_with_texture_mapping() {
   int lighting = lighting_mode;
-  vec4 normal = inverse(transpose(model)) * normal_coefficients;
+  vec4 normal = inverse(transpose(model)) * (normal_sign * normal_coefficients);
   normal.w = 0.0;
 
   vec4 specular_term = vec4(0.0);
@@ -125,7 +126,7 @@ void gouraud_shading_with_texture_mapping() {
 
 vec4 flat_shading() {
   int lighting = lighting_mode;
-  vec4 normal = inverse(transpose(model)) * surface_normal_coefficients;
+  vec4 normal = inverse(transpose(model)) * (normal_sign * surface_normal_coefficients);
   normal.w = 0.0;
 
   vec4 specular_term = vec4(0.0);
@@ -151,7 +152,7 @@ vec4 flat_shading() {
 
 vec4 gouraud_shading() {
   int lighting = lighting_mode;
-  vec4 normal = inverse(transpose(model)) * normal_coefficients;
+  vec4 normal = inverse(transpose(model)) * (normal_sign * normal_coefficients);
   normal.w = 0.0;
 
   vec4 specular_term = vec4(0.0);
@@ -181,10 +182,10 @@ void main()
 
   world_position = model * model_coefficients;
 
-  normal = inverse(transpose(model)) * normal_coefficients;
+  normal = inverse(transpose(model)) * (normal_sign * normal_coefficients);
   normal.w = 0.0;
 
-  flatNormal = inverse(transpose(model)) * surface_normal_coefficients;
+  flatNormal = inverse(transpose(model)) * (normal_sign * surface_normal_coefficients);
   flatNormal.w = 0.0;
 
   if (has_texture)
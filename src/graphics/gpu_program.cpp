@@ -153,6 +153,8 @@ void CreateGpuProgram(OpenGL_GpuProgram* gpu_program)
     = glGetUniformLocation(gpu_program->program_id, "TextureImage1");
   gpu_program->has_texture_uniform
     = glGetUniformLocation(gpu_program->program_id, "has_texture");
+  gpu_program->normal_sign_uniform
+    = glGetUniformLocation(gpu_program->program_id, "normal_sign");
 }
 
 void CreateGpuProgram(Close2GL_GpuProgram* gpu_program) 
@@ -0,0 +1,189 @@
+#include "graphics/mesh_cache.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include "loaders.h"
+
+static size_t AlignOffset(size_t offset)
+{
+  return (offset + 15) & ~(size_t)15;
+}
+
+uint64_t HashFileContent(const char* data, size_t size)
+{
+  // FNV-1a over 8 byte words, the tail is hashed byte by byte
+  const uint64_t prime = 0x100000001b3ull;
+  uint64_t hash = 0xcbf29ce484222325ull;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, data + i, sizeof(word));
+    hash = (hash ^ word) * prime;
+  }
+  for (; i < size; i++)
+    hash = (hash ^ (uint8_t)data[i]) * prime;
+  return hash;
+}
+
+std::string MeshCachePath(const char* source_filename, std::string cache_dir)
+{
+  std::string source = source_filename;
+  if (cache_dir.empty())
+    return source + ".mcache";
+
+  size_t slash = source.find_last_of("/\\");
+  std::string base = slash == std::string::npos ? source : source.substr(slash + 1);
+  char last = cache_dir.back();
+  if (last != '/' && last != '\\')
+    cache_dir += '/';
+  return cache_dir + base + ".mcache";
+}
+
+template <typename T>
+static bool MapSection(const mapped_file_t &file, size_t *offset, uint64_t count, std::vector<T> *out)
+{
+  *offset = AlignOffset(*offset);
+  // count comes from the header, a corrupt one must not wrap the size
+  if (*offset > file.size || count > (file.size - *offset) / sizeof(T))
+    return false;
+  size_t bytes = count * sizeof(T);
+  const T *begin = (const T*)(file.data + *offset);
+  out->assign(begin, begin + count);
+  *offset += bytes;
+  return true;
+}
+
+bool ReadMeshCache(const char* cache_filename, uint64_t source_hash, uint64_t source_size, float weld_epsilon, model_t *model)
+{
+  std::ifstream probe(cache_filename, std::ios::binary);
+  if (!probe.good())
+    return false;
+  probe.close();
+
+  mapped_file_t file;
+  try {
+    file = MapFile(cache_filename);
+  } catch ( std::exception& e ) {
+    return false;
+  }
+
+  mesh_cache_header_t header;
+  bool valid = file.size >= sizeof(header);
+  if (valid) {
+    std::memcpy(&header, file.data, sizeof(header));
+    valid = header.magic == MESH_CACHE_MAGIC
+      && header.version == MESH_CACHE_VERSION
+      && header.triangle_size == sizeof(model_triangle_t)
+      && header.source_hash == source_hash
+      && header.source_size == source_size
+      && header.weld_epsilon == weld_epsilon;
+  }
+
+  model_t cached;
+  size_t offset = sizeof(header);
+  if (valid) {
+    std::vector<char> name;
+    valid = MapSection(file, &offset, header.name_length, &name)
+      && MapSection(file, &offset, header.material_count, &cached.materials)
+      && MapSection(file, &offset, header.triangle_count, &cached.triangles)
+      && MapSection(file, &offset, header.vertex_count, &cached.vertices)
+      && MapSection(file, &offset, header.normal_count, &cached.normals)
+      && MapSection(file, &offset, header.calculated_normal_count, &cached.calculated_normals)
+      && MapSection(file, &offset, header.raw_normal_count, &cached.raw_normals)
+      && MapSection(file, &offset, header.color_index_count, &cached.color_indices);
+    cached.model_name.assign(name.begin(), name.end());
+  }
+  UnmapFile(&file);
+
+  if (!valid)
+    return false;
+
+  cached.has_texture            = header.flags & MESH_CACHE_HAS_TEXTURE;
+  cached.has_calculated_normals = header.flags & MESH_CACHE_HAS_CALCULATED_NORMALS;
+  cached.calculated_ccw         = header.flags & MESH_CACHE_CALCULATED_CCW;
+  cached.bounding_box_min = glm::vec3(header.bounding_box_min[0], header.bounding_box_min[1], header.bounding_box_min[2]);
+  cached.bounding_box_max = glm::vec3(header.bounding_box_max[0], header.bounding_box_max[1], header.bounding_box_max[2]);
+
+  *model = std::move(cached);
+  return true;
+}
+
+// Sections are written in blocks of this many bytes, so a cancelled load
+// stops writing soon
+#define MESH_CACHE_WRITE_BLOCK ((size_t)16 << 20)
+
+// Returns false when cancelled before the section was written
+template <typename T>
+static bool WriteSection(std::ofstream &file, const T *data, size_t count, const std::atomic<bool> *cancel)
+{
+  static const char padding[16] = { 0 };
+  size_t offset = (size_t)file.tellp();
+  file.write(padding, AlignOffset(offset) - offset);
+
+  const char *bytes = (const char*)data;
+  size_t size = count * sizeof(T);
+  for (size_t written = 0; written < size; written += MESH_CACHE_WRITE_BLOCK) {
+    if (cancel && *cancel)
+      return false;
+    file.write(bytes + written, std::min(size - written, MESH_CACHE_WRITE_BLOCK));
+  }
+  return true;
+}
+
+void WriteMeshCache(const char* cache_filename, uint64_t source_hash, uint64_t source_size, float weld_epsilon, const model_t &model,
+                    const std::atomic<bool> *cancel)
+{
+  mesh_cache_header_t header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic         = MESH_CACHE_MAGIC;
+  header.version       = MESH_CACHE_VERSION;
+  header.source_hash   = source_hash;
+  header.source_size   = source_size;
+  header.triangle_size = sizeof(model_triangle_t);
+  header.weld_epsilon  = weld_epsilon;
+  header.flags = (model.has_texture ? MESH_CACHE_HAS_TEXTURE : 0)
+    | (model.has_calculated_normals ? MESH_CACHE_HAS_CALCULATED_NORMALS : 0)
+    | (model.calculated_ccw ? MESH_CACHE_CALCULATED_CCW : 0);
+  for (int i = 0; i < 3; i++) {
+    header.bounding_box_min[i] = model.bounding_box_min[i];
+    header.bounding_box_max[i] = model.bounding_box_max[i];
+  }
+  header.name_length             = model.model_name.size();
+  header.material_count          = model.materials.size();
+  header.triangle_count          = model.triangles.size();
+  header.vertex_count            = model.vertices.size();
+  header.normal_count            = model.normals.size();
+  header.calculated_normal_count = model.calculated_normals.size();
+  header.raw_normal_count        = model.raw_normals.size();
+  header.color_index_count       = model.color_indices.size();
+
+  // written under a temporary name so a crash never leaves a truncated cache
+  std::string temp_filename = std::string(cache_filename) + ".tmp";
+  std::ofstream file(temp_filename, std::ios::binary | std::ios::trunc);
+  if (!file.good()) {
+    std::cerr << "WARNING: Cannot write mesh cache \"" << cache_filename << "\"." << std::endl;
+    return;
+  }
+
+  file.write((const char*)&header, sizeof(header));
+  bool complete = WriteSection(file, model.model_name.data(), model.model_name.size(), cancel)
+    && WriteSection(file, model.materials.data(), model.materials.size(), cancel)
+    && WriteSection(file, model.triangles.data(), model.triangles.size(), cancel)
+    && WriteSection(file, model.vertices.data(), model.vertices.size(), cancel)
+    && WriteSection(file, model.normals.data(), model.normals.size(), cancel)
+    && WriteSection(file, model.calculated_normals.data(), model.calculated_normals.size(), cancel)
+    && WriteSection(file, model.raw_normals.data(), model.raw_normals.size(), cancel)
+    && WriteSection(file, model.color_indices.data(), model.color_indices.size(), cancel);
+  file.close();
+  if (!complete) {
+    std::remove(temp_filename.c_str());
+    return;
+  }
+
+  std::remove(cache_filename);
+  if (file.fail() || std::rename(temp_filename.c_str(), cache_filename) != 0) {
+    std::remove(temp_filename.c_str());
+    std::cerr << "WARNING: Cannot write mesh cache \"" << cache_filename << "\"." << std::endl;
+  }
+}
@@ -1,150 +1,671 @@
 #include "graphics/model.h"
+#include "graphics/mesh_cache.h"
+#include "graphics/obj_model.h"
+#include "graphics/ply_model.h"
+#include "graphics/tokenizer.h"
+#include "loaders.h"
+#include "parallel.h"
+
+#include <cmath>
+#include <cstring>
+#include <memory>
 
 using namespace std;
 
-model_t ReadModelFile(const char* filename)
-{ 
-  ifstream file;
-  try {
-    file.exceptions(ifstream::failbit);
-    file.open(filename);
-  } catch ( exception& e ) {
-    cerr << "ERROR: Cannot open file \"" << filename << "\"." << endl;
-    throw e;
+size_t weld_key_hash_t::operator()(const weld_key_t &k) const
+{
+  uint64_t h = (uint64_t)(uint32_t)k.x * 73856093u;
+  h ^= (uint64_t)(uint32_t)k.y * 19349663u;
+  h ^= (uint64_t)(uint32_t)k.z * 83492791u;
+  return (size_t)(h ^ (h >> 17));
+}
+
+bool weld_key_equal_t::operator()(const weld_key_t &a, const weld_key_t &b) const
+{
+  return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+static int32_t FloatKey(float f)
+{
+  if (f == 0.0f) // -0.0 and 0.0 compare equal, so they must share a key
+    return 0;
+  int32_t bits;
+  std::memcpy(&bits, &f, sizeof(bits));
+  return bits;
+}
+
+static int32_t CellCoord(float f, float epsilon)
+{
+  double cell = std::floor((double)f / epsilon);
+  cell = std::max(cell, (double)INT32_MIN);
+  cell = std::min(cell, (double)INT32_MAX);
+  return (int32_t)cell;
+}
+
+static bool InCellRange(int64_t cell)
+{
+  return cell >= INT32_MIN && cell <= INT32_MAX;
+}
+
+static weld_key_t WeldKey(vertex_welder_t *welder, glm::vec4 vertex)
+{
+  if (welder->epsilon > 0.0f)
+    return { CellCoord(vertex.x, welder->epsilon), 
+             CellCoord(vertex.y, welder->epsilon), 
+             CellCoord(vertex.z, welder->epsilon) };
+  return { FloatKey(vertex.x), FloatKey(vertex.y), FloatKey(vertex.z) };
+}
+
+void InitVertexWelder(vertex_welder_t *welder, float epsilon, size_t expected_vertices)
+{
+  welder->epsilon = std::max(epsilon, 0.0f);
+  welder->cells.clear();
+  welder->cells.reserve(expected_vertices);
+  welder->next.clear();
+  welder->next.reserve(expected_vertices);
+}
+
+int WeldVertex(vertex_welder_t *welder, std::vector<glm::vec4> *vertices, glm::vec4 vertex, bool *is_new)
+{
+  weld_key_t key = WeldKey(welder, vertex);
+
+  if (welder->epsilon > 0.0f) {
+    // a vertex within epsilon may lie in any of the neighbour cells, the 
+    // lowest index wins so the result does not depend on the hash order
+    float max_distance = welder->epsilon * welder->epsilon;
+    int found = -1;
+    for (int dz = -1; dz <= 1; dz++)
+      for (int dy = -1; dy <= 1; dy++)
+        for (int dx = -1; dx <= 1; dx++) {
+          // clamped keys sit at the ends of the int32 range, their
+          // neighbours past it do not exist
+          int64_t x = (int64_t)key.x + dx, y = (int64_t)key.y + dy, z = (int64_t)key.z + dz;
+          if (!InCellRange(x) || !InCellRange(y) || !InCellRange(z))
+            continue;
+          weld_key_t cell = { (int32_t)x, (int32_t)y, (int32_t)z };
+          auto it = welder->cells.find(cell);
+          if (it == welder->cells.end())
+            continue;
+          for (int i = it->second; i != -1; i = welder->next[i]) {
+            glm::vec4 d = (*vertices)[i] - vertex;
+            if (d.x*d.x + d.y*d.y + d.z*d.z <= max_distance && (found == -1 || i < found))
+              found = i;
+          }
+        }
+    if (found != -1) {
+      *is_new = false;
+      return found;
+    }
+  } else {
+    auto it = welder->cells.find(key);
+    if (it != welder->cells.end())
+      for (int i = it->second; i != -1; i = welder->next[i])
+        if ((*vertices)[i] == vertex) {
+          *is_new = false;
+          return i;
+        }
   }
 
-  model_t model;
+  int index = vertices->size();
+  vertices->push_back(vertex);
 
-  string str;
-  
-  file >> str >> str >> str >> model.model_name;
+  auto head = welder->cells.emplace(key, index);
+  if (head.second) {
+    welder->next.push_back(-1);
+  } else {
+    welder->next.push_back(head.first->second);
+    head.first->second = index;
+  }
 
-  int triangle_count;
-  file >> str >> str >> str >> triangle_count;
+  *is_new = true;
+  return index;
+}
 
-  int material_count;
-  file >> str >> str >> str >> material_count;
+// Triangles read from one slice of the file. Their indices point into the
+// chunk's own vertex list until the chunks are merged into the model.
+typedef struct {
+  const char *begin, *end;
+  std::vector<model_triangle_t> triangles;
+  std::vector<glm::vec4> vertices;
+  std::vector<unsigned int> color_indices;
+  std::vector<float> raw_normals;
+  glm::vec3 bounding_box_min = glm::vec3(0.0f);
+  glm::vec3 bounding_box_max = glm::vec3(0.0f);
+} model_chunk_t;
+
+// Smallest slice worth handing to another thread
+#define MIN_CHUNK_SIZE (1 << 20)
+
+static int ParseModelHeader(tokenizer_t *tk, model_t *model)
+{
+  SkipWords(tk, 3);
+  model->model_name = std::string(NextWord(tk));
+
+  SkipWords(tk, 3);
+  int triangle_count = NextInt(tk);
+
+  SkipWords(tk, 3);
+  int material_count = NextInt(tk);
 
   for (int i = 0; i < material_count; ++i)
   {
     material_t material;
-    file >> str >> str 
-      >> material.ambient[0] >> material.ambient[1] >> material.ambient[2];
-    file >> str >> str 
-      >> material.diffuse[0] >> material.diffuse[1] >> material.diffuse[2];
-    file >> str >> str 
-      >> material.specular[0] >> material.specular[1] >> material.specular[2];
-    file >> str >> str >> material.shininess;
-    model.materials.push_back(material);
-  }
-
-  file >> str >> str >> str;
-  model.has_texture = str == "YES";
+    SkipWords(tk, 2);
+    for (int c = 0; c < 3; c++)
+      material.ambient[c] = NextFloat(tk);
+    SkipWords(tk, 2);
+    for (int c = 0; c < 3; c++)
+      material.diffuse[c] = NextFloat(tk);
+    SkipWords(tk, 2);
+    for (int c = 0; c < 3; c++)
+      material.specular[c] = NextFloat(tk);
+    SkipWords(tk, 2);
+    material.shininess = NextFloat(tk);
+    model->materials.push_back(material);
+  }
+
+  SkipWords(tk, 2);
+  model->has_texture = NextWord(tk) == "YES";
   
-  getline(file, str); 
-  getline(file, str);
+  SkipLine(tk); 
+  SkipLine(tk);
+
+  return triangle_count;
+}
+
+// Every record starts with a "v0" line, so the next one after any position 
+// is a safe place to split the file
+static const char* FindRecordStart(const char *position, const char *end)
+{
+  while (position < end) {
+    while (position < end && *position != '\n')
+      position++;
+    if (position < end)
+      position++;
+
+    const char *line = position;
+    while (line < end && (*line == ' ' || *line == '\t' || *line == '\r'))
+      line++;
+    if (end - line > 2 && line[0] == 'v' && line[1] == '0' && IsSpace(line[2]))
+      return position;
+  }
+  return end;
+}
+
+// Parses the records that start inside [chunk->begin, chunk->end). With weld
+// off every corner gets its own vertex and welding is left to the merge.
+static void ParseModelChunk(model_chunk_t *chunk, bool has_texture, bool weld, float weld_epsilon, 
+                            size_t max_triangles, size_t expected_triangles, model_load_progress_t *progress)
+{
+  tokenizer_t tk = { chunk->begin, chunk->end };
+  const char *reported = tk.current;
+
+  vertex_welder_t welder;
+  if (weld)
+    InitVertexWelder(&welder, weld_epsilon, expected_triangles);
+
+  chunk->triangles.reserve(expected_triangles);
+  chunk->raw_normals.reserve(12 * expected_triangles);
   
-  for (int a = 0; a < triangle_count; ++a)
+  while (chunk->triangles.size() < max_triangles && !AtEnd(&tk))
   {
-    model_triangle_t triangle;
+    if (progress && (chunk->triangles.size() & 4095) == 0) {
+      if (progress->cancel)
+        throw std::runtime_error("Model loading cancelled");
+      progress->bytes_done += tk.current - reported;
+      reported = tk.current;
+    }
+
+    model_triangle_t triangle = {};
     for (int v = 0; v < 3; ++v)
     {
-      float vx, vy, vz, nx, ny, nz, s, t;
-      int color_index;
-
-      file >> str >> vx >> vy >> vz >> nx >> ny >> nz >> color_index;
-      if (model.has_texture)
-        file >> s >> t;
+      SkipWords(&tk, 1);
+      float vx = NextFloat(&tk), vy = NextFloat(&tk), vz = NextFloat(&tk);
+      float nx = NextFloat(&tk), ny = NextFloat(&tk), nz = NextFloat(&tk);
+      int color_index = NextInt(&tk);
       
       glm::vec4 vertex = glm::vec4(vx, vy, vz, 1.0f);
 
-      int index = -1;
-      for (int i = 0; i < model.vertices.size(); i++)
-        if (vertex == model.vertices[i])
-          index = i;
-      if (index == -1) {
-        index = model.vertices.size();
-        model.vertices.push_back(vertex);
-
-        glm::vec4 normal = glm::vec4(vx, vy, vz, 0.0f);
-        model.normals.push_back(normal);
-        
-        model.color_indices.push_back(color_index);   
+      bool is_new = true;
+      int index;
+      if (weld) {
+        index = WeldVertex(&welder, &chunk->vertices, vertex, &is_new);
+      } else {
+        index = chunk->vertices.size();
+        chunk->vertices.push_back(vertex);
       }
+      if (is_new)
+        chunk->color_indices.push_back(color_index);   
 
       triangle.indices[v] = index;
+      if (v == 0)
+        triangle.material_index = color_index;
 
-      if (model.has_texture)
-        triangle.tex_coords[v*2]   = s;
-        triangle.tex_coords[v*2+1] = t;
+      if (has_texture) {
+        triangle.tex_coords[v*2]   = NextFloat(&tk);
+        triangle.tex_coords[v*2+1] = NextFloat(&tk);
+      }
 
-      model.raw_normals.push_back(nx);
-      model.raw_normals.push_back(ny);
-      model.raw_normals.push_back(nz);
-      model.raw_normals.push_back(0.0f);
+      chunk->raw_normals.push_back(nx);
+      chunk->raw_normals.push_back(ny);
+      chunk->raw_normals.push_back(nz);
+      chunk->raw_normals.push_back(0.0f);
     
-      model.bounding_box_min.x = std::min(model.bounding_box_min.x, vx);
-      model.bounding_box_min.y = std::min(model.bounding_box_min.y, vy);
-      model.bounding_box_min.z = std::min(model.bounding_box_min.z, vz);
-      model.bounding_box_max.x = std::max(model.bounding_box_max.x, vx);
-      model.bounding_box_max.y = std::max(model.bounding_box_max.y, vy);
-      model.bounding_box_max.z = std::max(model.bounding_box_max.z, vz);    
+      chunk->bounding_box_min.x = std::min(chunk->bounding_box_min.x, vx);
+      chunk->bounding_box_min.y = std::min(chunk->bounding_box_min.y, vy);
+      chunk->bounding_box_min.z = std::min(chunk->bounding_box_min.z, vz);
+      chunk->bounding_box_max.x = std::max(chunk->bounding_box_max.x, vx);
+      chunk->bounding_box_max.y = std::max(chunk->bounding_box_max.y, vy);
+      chunk->bounding_box_max.z = std::max(chunk->bounding_box_max.z, vz);    
     }
     
-    float fnx, fny, fnz;
-    file >> str >> str >> fnx >> fny >> fnz;
+    SkipWords(&tk, 2);
+    float fnx = NextFloat(&tk), fny = NextFloat(&tk), fnz = NextFloat(&tk);
 
     triangle.face_normal = glm::vec4(fnx, fny, fnz, 0.0);
 
-    model.triangles.push_back(triangle);
+    chunk->triangles.push_back(triangle);
+  }
+
+  if (progress)
+    progress->bytes_done += chunk->end - reported;
+}
+
+// Chunks are merged in file order and their vertices welded again, so the
+// indices come out exactly as a single-threaded read would produce them
+static void MergeModelChunk(model_t *model, vertex_welder_t *welder, model_chunk_t *chunk, size_t max_triangles)
+{
+  std::vector<int> remap(chunk->vertices.size());
+  for (size_t i = 0; i < chunk->vertices.size(); i++) {
+    bool is_new;
+    remap[i] = WeldVertex(welder, &model->vertices, chunk->vertices[i], &is_new);
+    if (is_new) {
+      glm::vec4 v = chunk->vertices[i];
+      model->normals.push_back(glm::vec4(v.x, v.y, v.z, 0.0f));
+      model->color_indices.push_back(chunk->color_indices[i]);
+    }
+  }
+
+  size_t count = std::min(chunk->triangles.size(), max_triangles - model->triangles.size());
+  for (size_t t = 0; t < count; t++) {
+    model_triangle_t triangle = chunk->triangles[t];
+    for (int v = 0; v < 3; v++)
+      triangle.indices[v] = remap[triangle.indices[v]];
+    model->triangles.push_back(triangle);
+  }
+  model->raw_normals.insert(model->raw_normals.end(), 
+      chunk->raw_normals.begin(), chunk->raw_normals.begin() + 12 * count);
+
+  model->bounding_box_min = glm::min(model->bounding_box_min, chunk->bounding_box_min);
+  model->bounding_box_max = glm::max(model->bounding_box_max, chunk->bounding_box_max);
+}
+
+void PublishModelBatch(model_load_progress_t *progress, const model_t &model, size_t total_triangles, 
+                       size_t first_triangle, size_t first_vertex)
+{
+  model_batch_t batch;
+  batch.model_name      = model.model_name;
+  batch.has_texture     = model.has_texture;
+  batch.materials       = model.materials;
+  batch.total_triangles = total_triangles;
+
+  batch.triangles.assign(model.triangles.begin() + first_triangle, model.triangles.end());
+  batch.vertices.assign(model.vertices.begin() + first_vertex, model.vertices.end());
+  batch.color_indices.assign(model.color_indices.begin() + first_vertex, model.color_indices.end());
+  batch.raw_normals.assign(model.raw_normals.begin() + 12 * first_triangle, model.raw_normals.end());
+  batch.bounding_box_min = model.bounding_box_min;
+  batch.bounding_box_max = model.bounding_box_max;
+
+  std::lock_guard<std::mutex> lock(progress->batch_mutex);
+  progress->batches.push_back(std::move(batch));
+}
+
+static model_t ParseModelFile(const char* data, size_t size, model_load_options_t options)
+{ 
+  tokenizer_t tk = { data, data + size };
+  model_load_progress_t *progress = options.progress;
+  if (progress)
+    progress->bytes_total = size;
+
+  model_t model;
+  size_t triangle_count = std::max(ParseModelHeader(&tk, &model), 0);
+
+  // streamed loads use many small chunks so the first ones are shown early
+  bool publish = progress && progress->publish_batches;
+  int thread_count = options.thread_count > 0 ? options.thread_count : HardwareThreadCount();
+  size_t body_size = tk.end - tk.current;
+  size_t chunk_count = publish 
+    ? std::max(body_size / STREAM_CHUNK_SIZE, (size_t)1)
+    : std::min((size_t)thread_count, std::max(body_size / MIN_CHUNK_SIZE, (size_t)1));
+
+  std::vector<model_chunk_t> chunks(chunk_count);
+  const char *begin = tk.current;
+  for (size_t c = 0; c < chunk_count; c++) {
+    chunks[c].begin = begin;
+    if (c + 1 == chunk_count)
+      chunks[c].end = tk.end;
+    else
+      chunks[c].end = FindRecordStart(std::max(begin, tk.current + body_size * (c+1) / chunk_count), tk.end);
+    begin = chunks[c].end;
+  }
+
+  // welding with a tolerance depends on the order vertices are seen, so in 
+  // that case only the merge welds
+  bool weld_chunks = chunk_count == 1 || options.weld_epsilon <= 0.0f;
+  if (progress)
+    progress->bytes_done += tk.current - data;
+
+  if (chunk_count == 1) {
+    model_chunk_t &chunk = chunks[0];
+    ParseModelChunk(&chunk, model.has_texture, weld_chunks, options.weld_epsilon, triangle_count, triangle_count, progress);
+    model.triangles        = std::move(chunk.triangles);
+    model.vertices         = std::move(chunk.vertices);
+    model.color_indices    = std::move(chunk.color_indices);
+    model.raw_normals      = std::move(chunk.raw_normals);
+    model.bounding_box_min = chunk.bounding_box_min;
+    model.bounding_box_max = chunk.bounding_box_max;
+
+    model.normals.reserve(model.vertices.size());
+    for (glm::vec4 v : model.vertices)
+      model.normals.push_back(glm::vec4(v.x, v.y, v.z, 0.0f));
+
+    if (publish)
+      PublishModelBatch(progress, model, triangle_count, 0, 0);
+  } else {
+    vertex_welder_t welder;
+    InitVertexWelder(&welder, options.weld_epsilon, triangle_count);
+    model.triangles.reserve(triangle_count);
+    model.raw_normals.reserve(12 * triangle_count);
+
+    // chunks are merged strictly in file order by whichever thread holds 
+    // the merge lock, while the other threads keep parsing
+    std::unique_ptr<std::atomic<bool>[]> parsed(new std::atomic<bool>[chunk_count]);
+    for (size_t c = 0; c < chunk_count; c++)
+      parsed[c] = false;
+    std::atomic<size_t> next_merge(0);
+    std::mutex merge_mutex;
+
+    ParallelFor(chunk_count, thread_count, [&](size_t c, int thread) {
+      size_t expected = triangle_count * (chunks[c].end - chunks[c].begin) / std::max(body_size, (size_t)1);
+      ParseModelChunk(&chunks[c], model.has_texture, weld_chunks, options.weld_epsilon, triangle_count, expected, progress);
+      parsed[c] = true;
+
+      while (next_merge < chunk_count && parsed[next_merge] && merge_mutex.try_lock()) {
+        while (next_merge < chunk_count && parsed[next_merge]) {
+          size_t first_triangle = model.triangles.size();
+          size_t first_vertex   = model.vertices.size();
+          MergeModelChunk(&model, &welder, &chunks[next_merge], triangle_count);
+          chunks[next_merge] = model_chunk_t();
+          if (publish && model.triangles.size() > first_triangle)
+            PublishModelBatch(progress, model, triangle_count, first_triangle, first_vertex);
+          next_merge++;
+        }
+        merge_mutex.unlock();
+      }
+    });
   }
-  file.close();
+
+  if (model.triangles.size() < triangle_count)
+    throw std::runtime_error("Unexpected end of file");
 
   return model;
 }
 
-void CalculateNormals(model_t *model, bool ccw_face)
+material_t DefaultMaterial()
 {
-  for (std::vector<model_triangle_t>::iterator it = model->triangles.begin();
-       it != model->triangles.end(); ++it) {
-    
-    glm::vec4 v0 = model->vertices[it->indices[0]];
-    glm::vec4 v1 = model->vertices[it->indices[1]];
-    glm::vec4 v2 = model->vertices[it->indices[2]];
+  material_t material;
+  for (int c = 0; c < 3; c++) {
+    material.ambient[c]  = 0.2f;
+    material.diffuse[c]  = 0.8f;
+    material.specular[c] = 0.0f;
+  }
+  material.shininess = 1.0f;
+  return material;
+}
+
+static model_t ParseSourceFile(const char* filename, const char* data, size_t size, model_load_options_t options)
+{
+  if (IsObjFile(filename))
+    return ParseObjFile(filename, data, size, options);
+  if (IsPlyFile(filename))
+    return ParsePlyFile(filename, data, size, options);
+  return ParseModelFile(data, size, options);
+}
+
+// The materials of an OBJ live in other files, which must also be unchanged
+// for its cache to be valid
+static uint64_t HashSourceFile(const char* filename, const char* data, size_t size)
+{
+  uint64_t hash = HashFileContent(data, size);
+  if (!IsObjFile(filename))
+    return hash;
+
+  for (const std::string &library : ObjMaterialLibraries(filename, data, size)) {
+    uint64_t library_hash = 0;
+    std::ifstream probe(library, std::ios::binary);
+    if (probe.good()) {
+      probe.close();
+      mapped_file_t file = MapFile(library.c_str());
+      library_hash = HashFileContent(file.data, file.size);
+      UnmapFile(&file);
+    }
+    hash = (hash ^ library_hash) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+model_t ReadModelFile(const char* filename, model_load_options_t options)
+{
+  mapped_file_t source = MapFile(filename);
+
+  model_t model;
+  try {
+    if (!options.use_mesh_cache) {
+      model = ParseSourceFile(filename, source.data, source.size, options);
+      UnmapFile(&source);
+      return model;
+    }
+
+    uint64_t source_hash = HashSourceFile(filename, source.data, source.size);
+    uint64_t source_size = source.size;
+
+    std::string cache_filename = MeshCachePath(filename, options.cache_dir);
+    if (ReadMeshCache(cache_filename.c_str(), source_hash, source_size, options.weld_epsilon, &model)) {
+      UnmapFile(&source);
+      return model;
+    }
+
+    model = ParseSourceFile(filename, source.data, source.size, options);
+    UnmapFile(&source);
+
+    const std::atomic<bool> *cancel = options.progress ? &options.progress->cancel : nullptr;
+    CalculateNormals(&model, options.ccw_face, options.thread_count, cancel);
+    WriteMeshCache(cache_filename.c_str(), source_hash, source_size, options.weld_epsilon, model, cancel);
+  } catch ( std::exception& e ) {
+    UnmapFile(&source);
+    if (options.progress && options.progress->cancel)
+      throw;
+    cerr << "ERROR: Cannot read model file \"" << filename << "\": " << e.what() << endl;
+    throw;
+  }
+  return model;
+}
 
-    glm::vec4 u = ccw_face ? v1 - v0 : v2 - v0;
-    glm::vec4 v = ccw_face ? v2 - v0 : v1 - v0;
+static glm::vec4 TriangleNormal(const model_t *model, const model_triangle_t &t, bool ccw_face)
+{
+  glm::vec4 v0 = model->vertices[t.indices[0]];
+  glm::vec4 v1 = model->vertices[t.indices[1]];
+  glm::vec4 v2 = model->vertices[t.indices[2]];
+
+  glm::vec4 u = ccw_face ? v1 - v0 : v2 - v0;
+  glm::vec4 v = ccw_face ? v2 - v0 : v1 - v0;
+
+  return matrices::cw_surface_normal(u, v);
+}
+
+// A corner that repeats an earlier vertex of a degenerate triangle, which
+// must only count once for that vertex
+static bool IsRepeatedCorner(const model_triangle_t &t, int corner)
+{
+  return (corner >= 1 && t.indices[corner] == t.indices[0])
+      || (corner == 2 && t.indices[2] == t.indices[1]);
+}
+
+// Counting sort of the triangles by vertex, each list keeps the triangles 
+// in model order so gathering them adds the normals in the same order as
+// the serial scatter
+// Work unit of the parallel normal passes, and how often the serial ones
+// look for a cancel
+#define NORMAL_BLOCK_SIZE (1 << 14)
 
-    it->calculated_face_normal = matrices::cw_surface_normal(u, v);
+static void CheckCancel(const std::atomic<bool> *cancel)
+{
+  if (cancel && *cancel)
+    throw std::runtime_error("Model loading cancelled");
+}
+
+static void BuildVertexFaces(model_t *model, const std::atomic<bool> *cancel)
+{
+  std::vector<int> &offsets = model->vertex_face_offsets;
+  offsets.assign(model->vertices.size() + 1, 0);
+  for (size_t i = 0; i < model->triangles.size(); i++) {
+    if (i % NORMAL_BLOCK_SIZE == 0)
+      CheckCancel(cancel);
+    const model_triangle_t &t = model->triangles[i];
+    for (int v = 0; v < 3; v++)
+      if (!IsRepeatedCorner(t, v))
+        offsets[t.indices[v] + 1]++;
   }
+  for (size_t i = 1; i < offsets.size(); i++)
+    offsets[i] += offsets[i-1];
+
+  std::vector<int> next(offsets.begin(), offsets.end() - 1);
+  model->vertex_faces.resize(offsets.back());
+  for (size_t i = 0; i < model->triangles.size(); i++) {
+    if (i % NORMAL_BLOCK_SIZE == 0)
+      CheckCancel(cancel);
+    const model_triangle_t &t = model->triangles[i];
+    for (int v = 0; v < 3; v++)
+      if (!IsRepeatedCorner(t, v))
+        model->vertex_faces[next[t.indices[v]]++] = i;
+  }
+  model->vertex_faces_triangle_count = model->triangles.size();
+}
 
-  model->calculated_normals.clear();
-  for (int i = 0; i < model->vertices.size(); i++) {
-    glm::vec4 calculated_normal = glm::vec4(0.0);
-    int count_triangles = 0;
+void CalculateNormals(model_t *model, bool ccw_face, int thread_count, const std::atomic<bool> *cancel)
+{
+  size_t triangle_count = model->triangles.size();
+  size_t vertex_count   = model->vertices.size();
+  if (thread_count <= 0)
+    thread_count = HardwareThreadCount();
+
+  model->calculated_normals.assign(vertex_count, glm::vec4(0.0f));
+
+  if (thread_count == 1) {
+    std::vector<int> count_triangles(vertex_count, 0);
+    for (size_t i = 0; i < triangle_count; i++) {
+      if (i % NORMAL_BLOCK_SIZE == 0)
+        CheckCancel(cancel);
+      model_triangle_t &t = model->triangles[i];
+      glm::vec4 face_normal = TriangleNormal(model, t, ccw_face);
+      for (int v = 0; v < 3; v++)
+        if (!IsRepeatedCorner(t, v)) {
+          model->calculated_normals[t.indices[v]] += face_normal;
+          count_triangles[t.indices[v]]++;
+        }
+      t.calculated_face_normal = glm::normalize(face_normal);
+    }
 
-    for (model_triangle_t t : model->triangles)
-      if (t.indices[0] == i || t.indices[1] == i || t.indices[2] == i) {
-        calculated_normal += t.calculated_face_normal;
-        count_triangles++;
+    for (size_t i = 0; i < vertex_count; i++)
+      model->calculated_normals[i] = glm::normalize(model->calculated_normals[i]/(float)count_triangles[i]);
+  } else {
+    if (model->vertex_faces_triangle_count != triangle_count || model->vertex_face_offsets.size() != vertex_count + 1)
+      BuildVertexFaces(model, cancel);
+
+    // face normals stay unnormalized until every vertex has gathered them
+    ParallelFor((triangle_count + NORMAL_BLOCK_SIZE - 1) / NORMAL_BLOCK_SIZE, thread_count, [&](size_t block, int thread) {
+      CheckCancel(cancel);
+      size_t last = std::min((block + 1) * NORMAL_BLOCK_SIZE, triangle_count);
+      for (size_t i = block * NORMAL_BLOCK_SIZE; i < last; i++)
+        model->triangles[i].calculated_face_normal = TriangleNormal(model, model->triangles[i], ccw_face);
+    });
+
+    ParallelFor((vertex_count + NORMAL_BLOCK_SIZE - 1) / NORMAL_BLOCK_SIZE, thread_count, [&](size_t block, int thread) {
+      CheckCancel(cancel);
+      size_t last = std::min((block + 1) * NORMAL_BLOCK_SIZE, vertex_count);
+      for (size_t i = block * NORMAL_BLOCK_SIZE; i < last; i++) {
+        glm::vec4 calculated_normal = glm::vec4(0.0f);
+        int first = model->vertex_face_offsets[i], end = model->vertex_face_offsets[i+1];
+        for (int f = first; f < end; f++)
+          calculated_normal += model->triangles[model->vertex_faces[f]].calculated_face_normal;
+        model->calculated_normals[i] = glm::normalize(calculated_normal/(float)(end - first));
       }
+    });
 
-    calculated_normal = glm::normalize(calculated_normal/(float)count_triangles);
-    model->calculated_normals.push_back(calculated_normal);
+    ParallelFor((triangle_count + NORMAL_BLOCK_SIZE - 1) / NORMAL_BLOCK_SIZE, thread_count, [&](size_t block, int thread) {
+      size_t last = std::min((block + 1) * NORMAL_BLOCK_SIZE, triangle_count);
+      for (size_t i = block * NORMAL_BLOCK_SIZE; i < last; i++)
+        model->triangles[i].calculated_face_normal = glm::normalize(model->triangles[i].calculated_face_normal);
+    });
   }
 
-  for (std::vector<model_triangle_t>::iterator it = model->triangles.begin();
-       it != model->triangles.end(); ++it) {
-    it->calculated_face_normal = glm::normalize(it->calculated_face_normal);
+  model->has_calculated_normals = true;
+  model->calculated_ccw = ccw_face;
+}
+
+void AppendModelBatch(model_t *model, std::vector<glm::vec4> *normal_sums, const model_batch_t &batch, bool ccw_face)
+{
+  if (model->triangles.empty()) {
+    model->model_name  = batch.model_name;
+    model->has_texture = batch.has_texture;
+    model->triangles.reserve(batch.total_triangles);
+    model->raw_normals.reserve(12 * batch.total_triangles);
+  }
+  model->materials = batch.materials; // an OBJ may still add some after its first faces
+
+  size_t first_triangle = model->triangles.size();
+  model->triangles.insert(model->triangles.end(), batch.triangles.begin(), batch.triangles.end());
+  model->vertices.insert(model->vertices.end(), batch.vertices.begin(), batch.vertices.end());
+  model->color_indices.insert(model->color_indices.end(), batch.color_indices.begin(), batch.color_indices.end());
+  model->raw_normals.insert(model->raw_normals.end(), batch.raw_normals.begin(), batch.raw_normals.end());
+  for (glm::vec4 v : batch.vertices)
+    model->normals.push_back(glm::vec4(v.x, v.y, v.z, 0.0f));
+  model->bounding_box_min = batch.bounding_box_min;
+  model->bounding_box_max = batch.bounding_box_max;
+
+  normal_sums->resize(model->vertices.size(), glm::vec4(0.0f));
+  model->calculated_normals.resize(model->vertices.size(), glm::vec4(0.0f));
+
+  for (size_t i = first_triangle; i < model->triangles.size(); i++) {
+    model_triangle_t &t = model->triangles[i];
+    glm::vec4 face_normal = TriangleNormal(model, t, ccw_face);
+    for (int v = 0; v < 3; v++)
+      (*normal_sums)[t.indices[v]] += face_normal;
+    t.calculated_face_normal = glm::normalize(face_normal);
   }
+  for (size_t i = first_triangle; i < model->triangles.size(); i++)
+    for (int v = 0; v < 3; v++) {
+      int index = model->triangles[i].indices[v];
+      model->calculated_normals[index] = glm::normalize((*normal_sums)[index]);
+    }
+
+  model->has_calculated_normals = true;
+  model->calculated_ccw = ccw_face;
 }
 
-std::vector<float> ExtractVertices(model_t model)
+static size_t ExtractEnd(const model_t &model, size_t first_triangle, size_t triangle_count)
+{
+  return first_triangle + std::min(triangle_count, model.triangles.size() - first_triangle);
+}
+
+std::vector<float> ExtractVertices(const model_t &model, size_t first_triangle, size_t triangle_count)
 {
   std::vector<float> vertices;
-  for (model_triangle_t t : model.triangles)
+  size_t end = ExtractEnd(model, first_triangle, triangle_count);
+  vertices.reserve(12 * (end - first_triangle));
+  for (size_t i = first_triangle; i < end; i++)
     for (int v = 0; v < 3; v++) {
-      glm::vec4 vertex = model.vertices[t.indices[v]];
+      glm::vec4 vertex = model.vertices[model.triangles[i].indices[v]];
       vertices.push_back(vertex.x);
       vertices.push_back(vertex.y);
       vertices.push_back(vertex.z);
@@ -153,12 +674,14 @@ std::vector<float> ExtractVertices(model_t model)
   return vertices;
 }
 
-std::vector<float> ExtractNormals(model_t model)
+std::vector<float> ExtractNormals(const model_t &model, size_t first_triangle, size_t triangle_count)
 {
   std::vector<float> normals;
-  for (model_triangle_t t : model.triangles)
+  size_t end = ExtractEnd(model, first_triangle, triangle_count);
+  normals.reserve(12 * (end - first_triangle));
+  for (size_t i = first_triangle; i < end; i++)
     for (int n = 0; n < 3; n++) {
-      glm::vec4 normal = model.normals[t.indices[n]];
+      glm::vec4 normal = model.normals[model.triangles[i].indices[n]];
       normals.push_back(normal.x);
       normals.push_back(normal.y);
       normals.push_back(normal.z);
@@ -166,12 +689,14 @@ std::vector<float> ExtractNormals(model_t model)
     }
   return normals;
 }
-std::vector<float> ExtractCalculatedNormals(model_t model)
+std::vector<float> ExtractCalculatedNormals(const model_t &model, size_t first_triangle, size_t triangle_count)
 {
   std::vector<float> normals;
-  for (model_triangle_t t : model.triangles)
+  size_t end = ExtractEnd(model, first_triangle, triangle_count);
+  normals.reserve(12 * (end - first_triangle));
+  for (size_t i = first_triangle; i < end; i++)
     for (int n = 0; n < 3; n++) {
-      glm::vec4 normal = model.calculated_normals[t.indices[n]];
+      glm::vec4 normal = model.calculated_normals[model.triangles[i].indices[n]];
       normals.push_back(normal.x);
       normals.push_back(normal.y);
       normals.push_back(normal.z);
@@ -179,11 +704,18 @@ std::vector<float> ExtractCalculatedNormals(model_t model)
     }
   return normals;
 }
-std::vector<float> ExtractSurfaceNormals(model_t model)
+std::vector<float> ExtractRawNormals(const model_t &model, size_t first_triangle, size_t triangle_count)
+{
+  size_t end = ExtractEnd(model, first_triangle, triangle_count);
+  return std::vector<float>(model.raw_normals.begin() + 12 * first_triangle, model.raw_normals.begin() + 12 * end);
+}
+std::vector<float> ExtractSurfaceNormals(const model_t &model, size_t first_triangle, size_t triangle_count)
 {
   std::vector<float> normals;
-  for (model_triangle_t t : model.triangles) {
-    glm::vec4 normal = t.face_normal;
+  size_t end = ExtractEnd(model, first_triangle, triangle_count);
+  normals.reserve(12 * (end - first_triangle));
+  for (size_t i = first_triangle; i < end; i++) {
+    glm::vec4 normal = model.triangles[i].face_normal;
     for (int n = 0; n < 3; n++) {
       normals.push_back(normal.x);
       normals.push_back(normal.y);
@@ -193,11 +725,13 @@ std::vector<float> ExtractSurfaceNormals(model_t model)
   }
   return normals;
 }
-std::vector<float> ExtractCalculatedSurfaceNormals(model_t model)
+std::vector<float> ExtractCalculatedSurfaceNormals(const model_t &model, size_t first_triangle, size_t triangle_count)
 {
   std::vector<float> normals;
-  for (model_triangle_t t : model.triangles) {
-    glm::vec4 normal = t.calculated_face_normal;
+  size_t end = ExtractEnd(model, first_triangle, triangle_count);
+  normals.reserve(12 * (end - first_triangle));
+  for (size_t i = first_triangle; i < end; i++) {
+    glm::vec4 normal = model.triangles[i].calculated_face_normal;
     for (int n = 0; n < 3; n++) {
       normals.push_back(normal.x);
       normals.push_back(normal.y);
@@ -207,11 +741,13 @@ std::vector<float> ExtractCalculatedSurfaceNormals(model_t model)
   }
   return normals;
 }
-std::vector<float> ExtractTextureCoords(model_t model)
+std::vector<float> ExtractTextureCoords(const model_t &model, size_t first_triangle, size_t triangle_count)
 {
   std::vector<float> texture_coords;
-  for (model_triangle_t t : model.triangles)
+  size_t end = ExtractEnd(model, first_triangle, triangle_count);
+  texture_coords.reserve(6 * (end - first_triangle));
+  for (size_t i = first_triangle; i < end; i++)
     for (int n = 0; n < 6; n++)
-      texture_coords.push_back(t.tex_coords[n]);
+      texture_coords.push_back(model.triangles[i].tex_coords[n]);
   return texture_coords;
-}
\ No newline at end of file
+}
@@ -0,0 +1,113 @@
+#include "graphics/model_benchmark.h"
+#include "graphics/obj_model.h"
+#include "graphics/ply_model.h"
+#include "graphics/tokenizer.h"
+#include "loaders.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+using namespace std;
+
+size_t CountWordsStream(const char* filename)
+{
+  ifstream file(filename);
+  if (!file.good())
+    throw std::runtime_error("Cannot open file");
+
+  size_t count = 0;
+  std::string word;
+  while (file >> word)
+    count++;
+  return count;
+}
+
+size_t CountWords(const char* filename)
+{
+  mapped_file_t file = MapFile(filename);
+  tokenizer_t tk = { file.data, file.data + file.size };
+  size_t count = 0;
+  while (!AtEnd(&tk)) {
+    NextWord(&tk);
+    count++;
+  }
+  UnmapFile(&file);
+  return count;
+}
+
+void WriteSyntheticModelFile(const char* filename, size_t triangle_count)
+{
+  size_t side = 2;
+  while (2 * (side - 1) * (side - 1) < triangle_count)
+    side++;
+
+  FILE *file = std::fopen(filename, "w");
+  if (!file)
+    throw std::runtime_error("Cannot write synthetic model");
+
+  std::fprintf(file, "Object name = SYNTHETIC\n# triangles = %zu\nMaterial count = 1\n", 2 * (side - 1) * (side - 1));
+  std::fprintf(file, "ambient color 0.2 0.2 0.2\ndiffuse color 0.8 0.8 0.8\nspecular color 0.5 0.5 0.5\nmaterial shine 10.0\n");
+  std::fprintf(file, "Texture = NO\n-- 3*[pos(x,y,z) normal(x,y,z) color_index] face_normal(x,y,z)\n");
+
+  // a height field, so every inner vertex is shared by six triangles
+  std::mt19937 random(42);
+  std::uniform_real_distribution<float> height(-0.05f, 0.05f);
+  std::vector<float> heights(side * side);
+  for (float &h : heights)
+    h = height(random);
+
+  auto corner = [&](const char *name, size_t i, size_t j) {
+    std::fprintf(file, "%s %f %f %f 0.0 0.0 1.0 0\n", name, (float)i / side, (float)j / side, heights[j * side + i]);
+  };
+  for (size_t j = 0; j + 1 < side; j++)
+    for (size_t i = 0; i + 1 < side; i++) {
+      corner("v0", i, j);     corner("v1", i + 1, j); corner("v2", i, j + 1);
+      std::fprintf(file, "face normal 0.0 0.0 1.0\n");
+      corner("v0", i + 1, j); corner("v1", i + 1, j + 1); corner("v2", i, j + 1);
+      std::fprintf(file, "face normal 0.0 0.0 1.0\n");
+    }
+
+  bool failed = std::ferror(file);
+  std::fclose(file);
+  if (failed)
+    throw std::runtime_error("Cannot write synthetic model");
+}
+
+double ModelParserThroughput(int parser, const char* filename, int repeats)
+{
+  // the word counts are only meaningful for a text format
+  ifstream probe(filename, ios::binary | ios::ate);
+  if (!probe.good() || IsObjFile(filename) || IsPlyFile(filename))
+    return 0.0;
+  double megabytes = probe.tellg() / (1024.0 * 1024.0);
+  probe.close();
+
+  model_load_options_t options;
+  options.thread_count = 1;
+  options.use_mesh_cache = false;
+
+  double best = 0.0;
+  for (int r = 0; r < repeats; r++) {
+    auto start = std::chrono::steady_clock::now();
+    switch (parser)
+    {
+      case MODEL_PARSER_STREAM_TOKENS: CountWordsStream(filename); break;
+      case MODEL_PARSER_TOKENS:        CountWords(filename); break;
+      default:                         ReadModelFile(filename, options);
+    }
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+    best = std::max(best, megabytes / seconds.count());
+  }
+  return best;
+}
+
+const char* ModelParserName(int parser)
+{
+  switch (parser)
+  {
+    case MODEL_PARSER_STREAM_TOKENS: return "ifstream words";
+    case MODEL_PARSER_TOKENS:        return "Tokenizer words";
+    default:                         return "ReadModelFile";
+  }
+}
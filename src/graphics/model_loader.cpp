@@ -0,0 +1,123 @@
+#include "graphics/model_loader.h"
+
+ModelLoader::~ModelLoader()
+{
+  this->Cancel();
+}
+
+void ModelLoader::Start(const char* filename, model_load_options_t options, double start_time, bool progressive)
+{
+  this->Cancel();
+
+  this->filename   = filename;
+  this->start_time = start_time;
+  this->total_triangles = 0;
+  this->error.clear();
+  this->model = model_t();
+  this->progress.bytes_done  = 0;
+  this->progress.bytes_total = 0;
+  this->progress.cancel      = false;
+  this->progress.publish_batches = progressive;
+  this->progress.batches.clear();
+  this->preview.reset();
+  this->preview_normal_sums.clear();
+  this->ccw_face = options.ccw_face;
+
+  options.progress = &this->progress;
+  this->state = LOADER_PARSING;
+  this->worker = std::thread(&ModelLoader::Run, this, options);
+}
+
+void ModelLoader::Cancel()
+{
+  this->progress.cancel = true;
+  this->Join();
+  this->state = LOADER_IDLE;
+}
+
+bool ModelLoader::IsLoading()
+{
+  int s = this->state;
+  return s == LOADER_PARSING || s == LOADER_NORMALS;
+}
+
+bool ModelLoader::IsReady()
+{
+  return this->state == LOADER_READY;
+}
+
+bool ModelLoader::HasFailed()
+{
+  return this->state == LOADER_FAILED;
+}
+
+float ModelLoader::Progress()
+{
+  size_t total = this->progress.bytes_total;
+  if (this->state == LOADER_NORMALS || this->state == LOADER_READY)
+    return 1.0f;
+  return total > 0 ? (float)this->progress.bytes_done / total : 0.0f;
+}
+
+const char* ModelLoader::StageName()
+{
+  switch (this->state)
+  {
+    case LOADER_PARSING: return "Reading model";
+    case LOADER_NORMALS: return "Calculating normals";
+    case LOADER_READY:   return "Ready";
+    case LOADER_FAILED:  return "Failed";
+    default:             return "";
+  }
+}
+
+model_t ModelLoader::TakeModel()
+{
+  this->Join();
+  this->state = LOADER_IDLE;
+  this->preview.reset();
+  return std::move(this->model);
+}
+
+model_ref_t ModelLoader::TakeBatches()
+{
+  std::vector<model_batch_t> batches;
+  {
+    std::lock_guard<std::mutex> lock(this->progress.batch_mutex);
+    batches.swap(this->progress.batches);
+  }
+  if (batches.empty())
+    return nullptr;
+
+  if (!this->preview)
+    this->preview = std::make_shared<model_t>();
+  for (const model_batch_t &batch : batches) {
+    AppendModelBatch(this->preview.get(), &this->preview_normal_sums, batch, this->ccw_face);
+    this->total_triangles = batch.total_triangles;
+  }
+  return this->preview;
+}
+
+void ModelLoader::Run(model_load_options_t options)
+{
+  try {
+    model_t loaded = ReadModelFile(this->filename.c_str(), options);
+
+    if (!loaded.has_calculated_normals) {
+      this->state = LOADER_NORMALS;
+      CalculateNormals(&loaded, options.ccw_face, options.thread_count, &this->progress.cancel);
+    }
+
+    this->model = std::move(loaded);
+    this->state = LOADER_READY;
+  } catch ( std::exception& e ) {
+    this->error = e.what();
+    this->state = this->progress.cancel ? LOADER_IDLE : LOADER_FAILED;
+  }
+}
+
+void ModelLoader::Join()
+{
+  if (this->worker.joinable())
+    this->worker.join();
+}
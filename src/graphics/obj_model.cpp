@@ -0,0 +1,302 @@
+#include "graphics/obj_model.h"
+#include "graphics/tokenizer.h"
+#include "loaders.h"
+
+#include <cstring>
+
+using namespace std;
+
+// One "v/vt/vn" reference of a face, already turned into 0 based indices.
+// Missing texture coordinates or normals are -1.
+typedef struct {
+  int position;
+  int tex_coord;
+  int normal;
+} obj_corner_t;
+
+bool IsObjFile(const char* filename)
+{
+  return HasExtension(filename, ".obj");
+}
+
+static std::string SiblingPath(const char* filename, std::string_view name)
+{
+  std::string path = filename;
+  size_t slash = path.find_last_of("/\\");
+  path = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+  return path + std::string(name);
+}
+
+std::vector<std::string> ObjMaterialLibraries(const char* filename, const char* data, size_t size)
+{
+  std::vector<std::string> libraries;
+  tokenizer_t tk = { data, data + size };
+  while (!AtEnd(&tk)) {
+    if (tk.end - tk.current > 6 && std::memcmp(tk.current, "mtllib", 6) == 0 && IsSpace(tk.current[6])) {
+      SkipWords(&tk, 1);
+      while (!AtLineEnd(&tk))
+        libraries.push_back(SiblingPath(filename, NextWord(&tk)));
+    }
+    SkipLine(&tk);
+  }
+  return libraries;
+}
+
+// Triangles the faces split into, so a streamed load knows the model size
+// before the first batch
+static size_t CountTriangles(const char* data, size_t size)
+{
+  size_t triangle_count = 0;
+  tokenizer_t tk = { data, data + size };
+  while (!AtEnd(&tk)) {
+    if (tk.end - tk.current > 1 && tk.current[0] == 'f' && IsSpace(tk.current[1])) {
+      SkipWords(&tk, 1);
+      size_t corners = 0;
+      for (; !AtLineEnd(&tk); corners++)
+        NextWord(&tk);
+      if (corners > 2)
+        triangle_count += corners - 2;
+    }
+    SkipLine(&tk);
+  }
+  return triangle_count;
+}
+
+// "Kd r g b" or "Kd r", which sets the three channels
+static void ReadColor(tokenizer_t *tk, float *color)
+{
+  color[0] = NextFloat(tk);
+  if (AtLineEnd(tk)) {
+    color[1] = color[2] = color[0];
+  } else {
+    color[1] = NextFloat(tk);
+    color[2] = NextFloat(tk);
+  }
+}
+
+static void ReadMaterialLibrary(const std::string &filename, model_t *model, std::unordered_map<std::string, int> *material_ids)
+{
+  mapped_file_t file;
+  try {
+    file = MapFile(filename.c_str());
+  } catch ( std::exception& e ) {
+    cerr << "WARNING: Cannot read material library \"" << filename << "\", using default materials." << endl;
+    return;
+  }
+
+  tokenizer_t tk = { file.data, file.data + file.size };
+  int material = -1;
+  try {
+    while (!AtEnd(&tk)) {
+      std::string_view keyword = NextWord(&tk);
+      if (keyword == "newmtl") {
+        material = model->materials.size();
+        (*material_ids)[std::string(RestOfLine(&tk))] = material;
+        model->materials.push_back(DefaultMaterial());
+      } else
+      if (material >= 0 && keyword == "Ka") {
+        ReadColor(&tk, model->materials[material].ambient);
+      } else
+      if (material >= 0 && keyword == "Kd") {
+        ReadColor(&tk, model->materials[material].diffuse);
+      } else
+      if (material >= 0 && keyword == "Ks") {
+        ReadColor(&tk, model->materials[material].specular);
+      } else
+      if (material >= 0 && keyword == "Ns") {
+        model->materials[material].shininess = NextFloat(&tk);
+      }
+      SkipLine(&tk);
+    }
+  } catch ( std::exception& e ) {
+    UnmapFile(&file);
+    cerr << "ERROR: Cannot read material library \"" << filename << "\": " << e.what() << endl;
+    throw;
+  }
+  UnmapFile(&file);
+}
+
+// OBJ indices start at 1, negative ones count back from the last element
+static int ResolveIndex(int index, size_t count)
+{
+  int resolved = index < 0 ? (int)count + index : index - 1;
+  if (resolved < 0 || resolved >= (int)count)
+    throw std::runtime_error("Face index out of range");
+  return resolved;
+}
+
+static void ParseFace(tokenizer_t *tk, size_t position_count, size_t tex_coord_count, size_t normal_count,
+                      std::vector<obj_corner_t> *face)
+{
+  face->clear();
+  while (!AtLineEnd(tk)) {
+    obj_corner_t corner = { ResolveIndex(NextInt(tk), position_count), -1, -1 };
+    if (tk->current < tk->end && *tk->current == '/') {
+      tk->current++;
+      if (tk->current < tk->end && *tk->current != '/')
+        corner.tex_coord = ResolveIndex(NextInt(tk), tex_coord_count);
+      if (tk->current < tk->end && *tk->current == '/') {
+        tk->current++;
+        corner.normal = ResolveIndex(NextInt(tk), normal_count);
+      }
+    }
+    face->push_back(corner);
+  }
+  if (face->size() < 3)
+    throw std::runtime_error("Face with less than three vertices");
+}
+
+model_t ParseObjFile(const char* filename, const char* data, size_t size, model_load_options_t options)
+{
+  tokenizer_t tk = { data, data + size };
+  model_load_progress_t *progress = options.progress;
+  if (progress)
+    progress->bytes_total = size;
+  const char *reported = tk.current;
+
+  model_t model;
+  std::unordered_map<std::string, int> material_ids;
+  int current_material = -1;
+  int default_material = -1;
+
+  std::vector<glm::vec4> positions;
+  std::vector<glm::vec2> tex_coords;
+  std::vector<glm::vec4> normals;
+  std::vector<int> vertex_ids; // welded model vertex of each OBJ position, -1 until used
+  std::vector<obj_corner_t> face;
+
+  vertex_welder_t welder;
+  InitVertexWelder(&welder, options.weld_epsilon, size / 64);
+
+  // the faces published so far, streamed loads hand them out every 
+  // STREAM_CHUNK_SIZE bytes
+  bool publish = progress && progress->publish_batches;
+  size_t triangle_count = publish ? CountTriangles(data, size) : 0;
+  size_t published_triangles = 0, published_vertices = 0;
+  const char *published = tk.current;
+  auto publish_batch = [&]() {
+    model.has_texture = !tex_coords.empty();
+    PublishModelBatch(progress, model, triangle_count, published_triangles, published_vertices);
+    published_triangles = model.triangles.size();
+    published_vertices  = model.vertices.size();
+    published = tk.current;
+  };
+
+  size_t line = 0;
+  while (!AtEnd(&tk))
+  {
+    if (progress && (++line & 4095) == 0) {
+      if (progress->cancel)
+        throw std::runtime_error("Model loading cancelled");
+      progress->bytes_done += tk.current - reported;
+      reported = tk.current;
+      if (publish && tk.current - published >= STREAM_CHUNK_SIZE && model.triangles.size() > published_triangles)
+        publish_batch();
+    }
+
+    std::string_view keyword = NextWord(&tk);
+    if (keyword == "v") {
+      float x = NextFloat(&tk), y = NextFloat(&tk), z = NextFloat(&tk);
+      positions.push_back(glm::vec4(x, y, z, 1.0f));
+      vertex_ids.push_back(-1);
+    } else
+    if (keyword == "vt") {
+      float u = NextFloat(&tk);
+      float v = AtLineEnd(&tk) ? 0.0f : NextFloat(&tk);
+      tex_coords.push_back(glm::vec2(u, v));
+    } else
+    if (keyword == "vn") {
+      float x = NextFloat(&tk), y = NextFloat(&tk), z = NextFloat(&tk);
+      normals.push_back(glm::vec4(x, y, z, 0.0f));
+    } else
+    if (keyword == "f") {
+      ParseFace(&tk, positions.size(), tex_coords.size(), normals.size(), &face);
+
+      int material = current_material;
+      if (material < 0) {
+        if (default_material < 0) {
+          default_material = model.materials.size();
+          model.materials.push_back(DefaultMaterial());
+        }
+        material = default_material;
+      }
+
+      for (size_t i = 1; i + 1 < face.size(); i++) {
+        obj_corner_t corners[3] = { face[0], face[i], face[i+1] };
+        model_triangle_t triangle = {};
+        triangle.material_index = material;
+
+        for (int v = 0; v < 3; v++) {
+          int &vertex_id = vertex_ids[corners[v].position];
+          if (vertex_id < 0) {
+            bool is_new;
+            glm::vec4 vertex = positions[corners[v].position];
+            vertex_id = WeldVertex(&welder, &model.vertices, vertex, &is_new);
+            if (is_new)
+              model.color_indices.push_back(material);
+
+            model.bounding_box_min = glm::min(model.bounding_box_min, glm::vec3(vertex));
+            model.bounding_box_max = glm::max(model.bounding_box_max, glm::vec3(vertex));
+          }
+          triangle.indices[v] = vertex_id;
+
+          if (corners[v].tex_coord >= 0) {
+            triangle.tex_coords[v*2]   = tex_coords[corners[v].tex_coord].x;
+            triangle.tex_coords[v*2+1] = tex_coords[corners[v].tex_coord].y;
+          }
+        }
+
+        glm::vec4 p0 = positions[corners[0].position];
+        glm::vec4 p1 = positions[corners[1].position];
+        glm::vec4 p2 = positions[corners[2].position];
+        glm::vec4 face_normal = matrices::cw_surface_normal(p1 - p0, p2 - p0);
+        if (glm::length(face_normal) > 0.0f)
+          face_normal = glm::normalize(face_normal);
+        triangle.face_normal = face_normal;
+
+        for (int v = 0; v < 3; v++) {
+          glm::vec4 normal = corners[v].normal >= 0 ? normals[corners[v].normal] : face_normal;
+          model.raw_normals.push_back(normal.x);
+          model.raw_normals.push_back(normal.y);
+          model.raw_normals.push_back(normal.z);
+          model.raw_normals.push_back(0.0f);
+        }
+
+        model.triangles.push_back(triangle);
+      }
+    } else
+    if (keyword == "usemtl") {
+      auto it = material_ids.find(std::string(RestOfLine(&tk)));
+      current_material = it == material_ids.end() ? -1 : it->second;
+    } else
+    if (keyword == "mtllib") {
+      while (!AtLineEnd(&tk))
+        ReadMaterialLibrary(SiblingPath(filename, NextWord(&tk)), &model, &material_ids);
+    } else
+    if ((keyword == "o" || keyword == "g") && model.model_name.empty()) {
+      model.model_name = std::string(RestOfLine(&tk));
+    }
+    SkipLine(&tk);
+  }
+
+  if (progress)
+    progress->bytes_done += tk.end - reported;
+  if (publish && model.triangles.size() > published_triangles)
+    publish_batch();
+
+  if (model.triangles.empty())
+    throw std::runtime_error("No faces in OBJ file");
+  if (model.model_name.empty()) {
+    model.model_name = filename;
+    size_t slash = model.model_name.find_last_of("/\\");
+    if (slash != std::string::npos)
+      model.model_name.erase(0, slash + 1);
+  }
+
+  model.has_texture = !tex_coords.empty();
+  model.normals.reserve(model.vertices.size());
+  for (glm::vec4 v : model.vertices)
+    model.normals.push_back(glm::vec4(v.x, v.y, v.z, 0.0f));
+
+  return model;
+}
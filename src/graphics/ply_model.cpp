@@ -0,0 +1,472 @@
+#include "graphics/ply_model.h"
+#include "graphics/tokenizer.h"
+#include "loaders.h"
+#include "parallel.h"
+
+#include <cstring>
+
+using namespace std;
+
+typedef enum {
+  PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64
+} ply_type_t;
+
+typedef struct {
+  std::string name;
+  ply_type_t  type;       // type of the elements for lists
+  bool        is_list;
+  ply_type_t  count_type;
+  size_t      offset;     // from the start of the record, only for fixed size records
+} ply_property_t;
+
+typedef struct {
+  std::string name;
+  size_t count;
+  std::vector<ply_property_t> properties;
+  bool   fixed_size; // true when no property is a list
+  size_t stride;     // record size of fixed size elements
+} ply_element_t;
+
+// Faces are handed to the threads in blocks of this many
+#define PLY_BLOCK_SIZE (1 << 16)
+
+bool IsPlyFile(const char* filename)
+{
+  return HasExtension(filename, ".ply");
+}
+
+static size_t TypeSize(ply_type_t type)
+{
+  switch (type)
+  {
+    case PLY_INT8:  case PLY_UINT8:  return 1;
+    case PLY_INT16: case PLY_UINT16: return 2;
+    case PLY_FLOAT64:                return 8;
+    default:                         return 4;
+  }
+}
+
+static ply_type_t ParseType(std::string_view name)
+{
+  if (name == "char"   || name == "int8")    return PLY_INT8;
+  if (name == "uchar"  || name == "uint8")   return PLY_UINT8;
+  if (name == "short"  || name == "int16")   return PLY_INT16;
+  if (name == "ushort" || name == "uint16")  return PLY_UINT16;
+  if (name == "int"    || name == "int32")   return PLY_INT32;
+  if (name == "uint"   || name == "uint32")  return PLY_UINT32;
+  if (name == "float"  || name == "float32") return PLY_FLOAT32;
+  if (name == "double" || name == "float64") return PLY_FLOAT64;
+  throw std::runtime_error("Unknown PLY property type");
+}
+
+template <typename T>
+static T Load(const char *p)
+{
+  T value;
+  std::memcpy(&value, p, sizeof(T));
+  return value;
+}
+
+static double ReadScalar(const char *p, ply_type_t type)
+{
+  switch (type)
+  {
+    case PLY_INT8:    return Load<int8_t>(p);
+    case PLY_UINT8:   return Load<uint8_t>(p);
+    case PLY_INT16:   return Load<int16_t>(p);
+    case PLY_UINT16:  return Load<uint16_t>(p);
+    case PLY_INT32:   return Load<int32_t>(p);
+    case PLY_UINT32:  return Load<uint32_t>(p);
+    case PLY_FLOAT32: return Load<float>(p);
+    default:          return Load<double>(p);
+  }
+}
+
+static int64_t ReadInteger(const char *p, ply_type_t type)
+{
+  switch (type)
+  {
+    case PLY_INT8:   return Load<int8_t>(p);
+    case PLY_UINT8:  return Load<uint8_t>(p);
+    case PLY_INT16:  return Load<int16_t>(p);
+    case PLY_UINT16: return Load<uint16_t>(p);
+    case PLY_INT32:  return Load<int32_t>(p);
+    case PLY_UINT32: return Load<uint32_t>(p);
+    default:         return (int64_t)ReadScalar(p, type);
+  }
+}
+
+// Returns the first byte after "end_header"
+static const char* ParsePlyHeader(const char* data, size_t size, std::vector<ply_element_t> *elements)
+{
+  tokenizer_t tk = { data, data + size };
+  if (NextWord(&tk) != "ply")
+    throw std::runtime_error("Not a PLY file");
+
+  while (!AtEnd(&tk))
+  {
+    std::string_view keyword = NextWord(&tk);
+    if (keyword == "format") {
+      if (NextWord(&tk) != "binary_little_endian")
+        throw std::runtime_error("Only binary little endian PLY files are supported");
+    } else
+    if (keyword == "element") {
+      ply_element_t element;
+      element.name = std::string(NextWord(&tk));
+      int count    = NextInt(&tk);
+      // every record takes at least a byte of what is left of the file
+      if (count < 0 || count > tk.end - tk.current)
+        throw std::runtime_error("Invalid PLY element count");
+      element.count      = count;
+      element.fixed_size = true;
+      element.stride     = 0;
+      elements->push_back(element);
+    } else
+    if (keyword == "property") {
+      if (elements->empty())
+        throw std::runtime_error("PLY property outside of an element");
+      ply_element_t &element = elements->back();
+      ply_property_t property;
+      std::string_view type = NextWord(&tk);
+      property.is_list = type == "list";
+      if (property.is_list) {
+        property.count_type = ParseType(NextWord(&tk));
+        property.type       = ParseType(NextWord(&tk));
+        element.fixed_size  = false;
+      } else {
+        property.type       = ParseType(type);
+        property.count_type = PLY_UINT8;
+      }
+      property.name   = std::string(NextWord(&tk));
+      property.offset = element.stride;
+      if (!property.is_list)
+        element.stride += TypeSize(property.type);
+      element.properties.push_back(property);
+    } else
+    if (keyword == "end_header") {
+      SkipLine(&tk);
+      return tk.current;
+    }
+    SkipLine(&tk);
+  }
+  throw std::runtime_error("PLY header without end_header");
+}
+
+static const ply_property_t* FindProperty(const ply_element_t &element, std::initializer_list<const char*> names)
+{
+  for (const char *name : names)
+    for (const ply_property_t &property : element.properties)
+      if (property.name == name)
+        return &property;
+  return nullptr;
+}
+
+// Size of one record of an element that has lists
+static size_t RecordSize(const ply_element_t &element, const char *record, const char *end)
+{
+  const char *p = record;
+  for (const ply_property_t &property : element.properties) {
+    if (property.is_list) {
+      if (p + TypeSize(property.count_type) > end)
+        throw std::runtime_error("Unexpected end of file");
+      int64_t count = ReadInteger(p, property.count_type);
+      p += TypeSize(property.count_type);
+      if (count < 0 || count > (end - p) / (int64_t)TypeSize(property.type))
+        throw std::runtime_error("Invalid PLY list count");
+      p += count * TypeSize(property.type);
+    } else {
+      p += TypeSize(property.type);
+    }
+  }
+  if (p > end)
+    throw std::runtime_error("Unexpected end of file");
+  return p - record;
+}
+
+// Triangles the polygons of the face element split into
+static size_t CountTriangles(const ply_element_t &element, const ply_property_t *indices, const char *record, const char *end)
+{
+  size_t triangle_count = 0;
+  for (size_t i = 0; i < element.count; i++) {
+    size_t record_size = RecordSize(element, record, end);
+    const char *p = record;
+    for (const ply_property_t &property : element.properties) {
+      if (&property == indices) {
+        int64_t count = ReadInteger(p, property.count_type);
+        if (count > 2)
+          triangle_count += count - 2;
+        break;
+      }
+      p += property.is_list 
+        ? TypeSize(property.count_type) + ReadInteger(p, property.count_type) * TypeSize(property.type)
+        : TypeSize(property.type);
+    }
+    record += record_size;
+  }
+  return triangle_count;
+}
+
+static void CheckProgress(model_load_progress_t *progress, size_t bytes)
+{
+  if (!progress)
+    return;
+  if (progress->cancel)
+    throw std::runtime_error("Model loading cancelled");
+  progress->bytes_done += bytes;
+}
+
+model_t ParsePlyFile(const char* filename, const char* data, size_t size, model_load_options_t options)
+{
+  model_load_progress_t *progress = options.progress;
+  if (progress)
+    progress->bytes_total = size;
+
+  std::vector<ply_element_t> elements;
+  const char *body = ParsePlyHeader(data, size, &elements);
+  const char *end  = data + size;
+  if (progress)
+    progress->bytes_done += body - data;
+
+  model_t model;
+  model.model_name = filename;
+  size_t slash = model.model_name.find_last_of("/\\");
+  if (slash != std::string::npos)
+    model.model_name.erase(0, slash + 1);
+  model.materials.push_back(DefaultMaterial());
+
+  const char *vertex_data = nullptr, *face_data = nullptr;
+  const ply_element_t *vertex_element = nullptr, *face_element = nullptr;
+  const char *p = body;
+  for (const ply_element_t &element : elements) {
+    if (element.name == "vertex") {
+      vertex_element = &element;
+      vertex_data = p;
+    } else
+    if (element.name == "face") {
+      face_element = &element;
+      face_data = p;
+    }
+
+    // the last element is checked while it is read instead of walked twice
+    if (&element == &elements.back())
+      break;
+
+    if (element.fixed_size) {
+      if (element.count * element.stride > (size_t)(end - p))
+        throw std::runtime_error("Unexpected end of file");
+      p += element.count * element.stride;
+    } else {
+      for (size_t i = 0; i < element.count; i++)
+        p += RecordSize(element, p, end);
+    }
+  }
+
+  if (!vertex_element || !face_element)
+    throw std::runtime_error("PLY file without vertex or face element");
+  if (!vertex_element->fixed_size)
+    throw std::runtime_error("PLY vertices with list properties are not supported");
+
+  const ply_property_t *x  = FindProperty(*vertex_element, { "x" });
+  const ply_property_t *y  = FindProperty(*vertex_element, { "y" });
+  const ply_property_t *z  = FindProperty(*vertex_element, { "z" });
+  const ply_property_t *nx = FindProperty(*vertex_element, { "nx" });
+  const ply_property_t *ny = FindProperty(*vertex_element, { "ny" });
+  const ply_property_t *nz = FindProperty(*vertex_element, { "nz" });
+  const ply_property_t *u  = FindProperty(*vertex_element, { "u", "s", "texture_u", "texture_s" });
+  const ply_property_t *v  = FindProperty(*vertex_element, { "v", "t", "texture_v", "texture_t" });
+  const ply_property_t *indices = FindProperty(*face_element, { "vertex_indices", "vertex_index" });
+  if (!x || !y || !z)
+    throw std::runtime_error("PLY vertices without position");
+  if (!indices || !indices->is_list)
+    throw std::runtime_error("PLY faces without vertex indices");
+
+  bool has_normals = nx && ny && nz;
+  model.has_texture = u && v;
+  int thread_count = options.thread_count > 0 ? options.thread_count : HardwareThreadCount();
+  bool publish = progress && progress->publish_batches;
+
+  // vertices
+  size_t vertex_count = vertex_element->count;
+  size_t stride = vertex_element->stride;
+  if (vertex_count * stride > (size_t)(end - vertex_data))
+    throw std::runtime_error("Unexpected end of file");
+  std::vector<glm::vec4> positions(vertex_count);
+  std::vector<glm::vec4> vertex_normals(has_normals ? vertex_count : 0);
+  std::vector<glm::vec2> vertex_uvs(model.has_texture ? vertex_count : 0);
+
+  ParallelFor((vertex_count + PLY_BLOCK_SIZE - 1) / PLY_BLOCK_SIZE, thread_count, [&](size_t block, int thread) {
+    size_t first = block * PLY_BLOCK_SIZE;
+    size_t last  = std::min(first + PLY_BLOCK_SIZE, vertex_count);
+    CheckProgress(progress, (last - first) * stride);
+    for (size_t i = first; i < last; i++) {
+      const char *record = vertex_data + i * stride;
+      if (x->type == PLY_FLOAT32 && y->offset == x->offset + 4 && z->offset == x->offset + 8
+          && y->type == PLY_FLOAT32 && z->type == PLY_FLOAT32) {
+        float xyz[3];
+        std::memcpy(xyz, record + x->offset, sizeof(xyz));
+        positions[i] = glm::vec4(xyz[0], xyz[1], xyz[2], 1.0f);
+      } else {
+        positions[i] = glm::vec4(ReadScalar(record + x->offset, x->type),
+                                 ReadScalar(record + y->offset, y->type),
+                                 ReadScalar(record + z->offset, z->type), 1.0f);
+      }
+      if (has_normals)
+        vertex_normals[i] = glm::vec4(ReadScalar(record + nx->offset, nx->type),
+                                      ReadScalar(record + ny->offset, ny->type),
+                                      ReadScalar(record + nz->offset, nz->type), 0.0f);
+      if (model.has_texture)
+        vertex_uvs[i] = glm::vec2(ReadScalar(record + u->offset, u->type),
+                                  ReadScalar(record + v->offset, v->type));
+    }
+  });
+
+  // PLY vertices are already indexed, the welder only runs to merge close ones
+  std::vector<int> vertex_ids;
+  if (options.weld_epsilon > 0.0f) {
+    vertex_welder_t welder;
+    InitVertexWelder(&welder, options.weld_epsilon, vertex_count);
+    vertex_ids.resize(vertex_count);
+    for (size_t i = 0; i < vertex_count; i++) {
+      bool is_new;
+      vertex_ids[i] = WeldVertex(&welder, &model.vertices, positions[i], &is_new);
+    }
+  } else {
+    model.vertices = positions;
+  }
+
+  for (const glm::vec4 &vertex : model.vertices) {
+    model.bounding_box_min = glm::min(model.bounding_box_min, glm::vec3(vertex));
+    model.bounding_box_max = glm::max(model.bounding_box_max, glm::vec3(vertex));
+  }
+  model.normals.resize(model.vertices.size());
+  for (size_t i = 0; i < model.vertices.size(); i++)
+    model.normals[i] = glm::vec4(model.vertices[i].x, model.vertices[i].y, model.vertices[i].z, 0.0f);
+  model.color_indices.assign(model.vertices.size(), 0);
+
+  auto make_triangle = [&](const int64_t *corners, model_triangle_t *triangle, float *raw_normals) {
+    for (int c = 0; c < 3; c++)
+      if (corners[c] < 0 || corners[c] >= (int64_t)vertex_count)
+        throw std::runtime_error("Face index out of range");
+
+    *triangle = {};
+    glm::vec4 p0 = positions[corners[0]], p1 = positions[corners[1]], p2 = positions[corners[2]];
+    glm::vec4 face_normal = matrices::cw_surface_normal(p1 - p0, p2 - p0);
+    if (glm::length(face_normal) > 0.0f)
+      face_normal = glm::normalize(face_normal);
+    triangle->face_normal = face_normal;
+
+    for (int c = 0; c < 3; c++) {
+      triangle->indices[c] = vertex_ids.empty() ? (int)corners[c] : vertex_ids[corners[c]];
+      if (model.has_texture) {
+        triangle->tex_coords[2*c]   = vertex_uvs[corners[c]].x;
+        triangle->tex_coords[2*c+1] = vertex_uvs[corners[c]].y;
+      }
+      glm::vec4 normal = has_normals ? vertex_normals[corners[c]] : face_normal;
+      raw_normals[4*c]   = normal.x;
+      raw_normals[4*c+1] = normal.y;
+      raw_normals[4*c+2] = normal.z;
+      raw_normals[4*c+3] = 0.0f;
+    }
+  };
+
+  // scanned meshes are nearly always plain triangles with a fixed record
+  // size, so every face can be found without walking the ones before it
+  size_t face_count = face_element->count;
+  size_t count_size = TypeSize(indices->count_type);
+  size_t index_size = TypeSize(indices->type);
+  bool fixed_triangles = face_element->properties.size() == 1;
+  size_t face_stride = count_size + 3 * index_size;
+  if (face_count * face_stride > (size_t)(end - face_data))
+    fixed_triangles = false;
+  for (size_t i = 0; fixed_triangles && i < face_count; i++) {
+    if ((i & (PLY_BLOCK_SIZE - 1)) == 0) // the first touch of the mapped faces is slow
+      CheckProgress(progress, 0);
+    fixed_triangles = ReadInteger(face_data + i * face_stride, indices->count_type) == 3;
+  }
+
+  if (fixed_triangles) {
+    model.triangles.reserve(face_count);
+    model.raw_normals.reserve(12 * face_count);
+
+    // the faces are read in slices, which streamed loads publish. Growing 
+    // the arrays zeroes them, so a cancel is also checked between slices.
+    size_t slice = publish 
+      ? std::max(STREAM_CHUNK_SIZE / face_stride, (size_t)PLY_BLOCK_SIZE)
+      : (size_t)PLY_BLOCK_SIZE * 4 * thread_count;
+    for (size_t begin = 0; begin < face_count; begin += slice) {
+      CheckProgress(progress, 0);
+      size_t slice_end = std::min(begin + slice, face_count);
+      model.triangles.resize(slice_end);
+      model.raw_normals.resize(12 * slice_end);
+
+      ParallelFor((slice_end - begin + PLY_BLOCK_SIZE - 1) / PLY_BLOCK_SIZE, thread_count, [&](size_t block, int thread) {
+        size_t first = begin + block * PLY_BLOCK_SIZE;
+        size_t last  = std::min(first + PLY_BLOCK_SIZE, slice_end);
+        CheckProgress(progress, (last - first) * face_stride);
+        for (size_t i = first; i < last; i++) {
+          const char *record = face_data + i * face_stride + count_size;
+          int64_t corners[3];
+          for (int c = 0; c < 3; c++)
+            corners[c] = ReadInteger(record + c * index_size, indices->type);
+          make_triangle(corners, &model.triangles[i], &model.raw_normals[12 * i]);
+        }
+      });
+
+      if (publish)
+        PublishModelBatch(progress, model, face_count, begin, begin == 0 ? 0 : model.vertices.size());
+    }
+  } else {
+    const char *record = face_data;
+    std::vector<int64_t> polygon;
+    model.triangles.reserve(face_count);
+    model.raw_normals.reserve(12 * face_count);
+
+    size_t triangle_count = publish ? CountTriangles(*face_element, indices, face_data, end) : 0;
+    size_t published_triangles = 0;
+    const char *published = record;
+    for (size_t i = 0; i < face_count; i++) {
+      if ((i & (PLY_BLOCK_SIZE - 1)) == 0) {
+        CheckProgress(progress, 0);
+        if (publish && record - published >= STREAM_CHUNK_SIZE && model.triangles.size() > published_triangles) {
+          PublishModelBatch(progress, model, triangle_count, published_triangles, published_triangles == 0 ? 0 : model.vertices.size());
+          published_triangles = model.triangles.size();
+          published = record;
+        }
+      }
+      RecordSize(*face_element, record, end);
+
+      for (const ply_property_t &property : face_element->properties) {
+        if (!property.is_list) {
+          record += TypeSize(property.type);
+          continue;
+        }
+        int64_t count = ReadInteger(record, property.count_type);
+        record += TypeSize(property.count_type);
+        if (&property == indices) {
+          polygon.resize(count);
+          for (int64_t c = 0; c < count; c++)
+            polygon[c] = ReadInteger(record + c * index_size, property.type);
+        }
+        record += count * TypeSize(property.type);
+      }
+
+      for (size_t c = 1; c + 1 < polygon.size(); c++) {
+        int64_t corners[3] = { polygon[0], polygon[c], polygon[c+1] };
+        model_triangle_t triangle;
+        float raw_normals[12];
+        make_triangle(corners, &triangle, raw_normals);
+        model.triangles.push_back(triangle);
+        model.raw_normals.insert(model.raw_normals.end(), raw_normals, raw_normals + 12);
+      }
+    }
+    if (progress)
+      progress->bytes_done += record - face_data;
+    if (publish && model.triangles.size() > published_triangles)
+      PublishModelBatch(progress, model, triangle_count, published_triangles, published_triangles == 0 ? 0 : model.vertices.size());
+  }
+
+  if (model.triangles.empty())
+    throw std::runtime_error("No faces in PLY file");
+
+  return model;
+}
@@ -0,0 +1,455 @@
+#include "graphics/vertex_kernels.h"
+#include "matrices.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <random>
+
+// The SIMD kernels use GCC/Clang target attributes so a single build runs
+// on any x86 CPU; other compilers only get the scalar kernel
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VERTEX_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+void ResizeSoa(vec4_soa_t *soa, size_t count)
+{
+  soa->x.resize(count);
+  soa->y.resize(count);
+  soa->z.resize(count);
+  soa->w.resize(count);
+}
+
+void ResizeTransformedVertices(transformed_vertices_t *vertices, size_t count)
+{
+  ResizeSoa(&vertices->clip_positions, count);
+  ResizeSoa(&vertices->screen_positions, count);
+  ResizeSoa(&vertices->ccs_positions, count);
+  ResizeSoa(&vertices->ccs_normals, count);
+  vertices->ww.resize(count);
+  vertices->outcodes.resize(count);
+}
+
+bool VertexIsaSupported(int isa)
+{
+  switch (isa)
+  {
+    case VERTEX_ISA_SCALAR:
+      return true;
+#ifdef VERTEX_KERNELS_X86
+    case VERTEX_ISA_SSE2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("sse2");
+    case VERTEX_ISA_AVX2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2");
+    case VERTEX_ISA_AVX512:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx512f");
+#endif
+    default:
+      return false;
+  }
+}
+
+int BestVertexIsa()
+{
+  int isa = VERTEX_ISA_COUNT - 1;
+  while (!VertexIsaSupported(isa))
+    isa--;
+  return isa;
+}
+
+const char* VertexIsaName(int isa)
+{
+  switch (isa)
+  {
+    case VERTEX_ISA_SSE2:   return "SSE2";
+    case VERTEX_ISA_AVX2:   return "AVX2";
+    case VERTEX_ISA_AVX512: return "AVX-512";
+    default:                return "Scalar";
+  }
+}
+
+unsigned char ClipOutcode(glm::vec4 v, float guard_band)
+{
+  unsigned char code = 0;
+  if (v.x < -v.w) code |= CLIP_LEFT;
+  if (v.x >  v.w) code |= CLIP_RIGHT;
+  if (v.y < -v.w) code |= CLIP_BOTTOM;
+  if (v.y >  v.w) code |= CLIP_TOP;
+  if (v.z < -v.w) code |= CLIP_NEAR;
+  if (v.z >  v.w) code |= CLIP_FAR;
+
+  float band = guard_band * v.w;
+  if (std::abs(v.x) > band || std::abs(v.y) > band)
+    code |= CLIP_GUARD_BAND;
+  return code;
+}
+
+static void TransformVerticesScalar(const vertex_transform_t &transform, const vec4_soa_t &positions, const vec4_soa_t &normals,
+                                    size_t first, size_t last, transformed_vertices_t *out)
+{
+  for (size_t i = first; i < last; i++)
+  {
+    glm::vec4 v = transform.mvp * SoaAt(positions, i);
+    float ww = 1.0f / v.w;
+
+    SoaSet(&out->clip_positions, i, v);
+    SoaSet(&out->screen_positions, i, transform.viewport * (v / v.w));
+    SoaSet(&out->ccs_positions, i, (transform.inverse_projection * v) * ww);
+    SoaSet(&out->ccs_normals, i, (transform.model_view * SoaAt(normals, i)) * ww);
+    out->ww[i] = ww;
+    out->outcodes[i] = ClipOutcode(v, transform.guard_band);
+  }
+}
+
+// The matrix products below add in the same order as glm, so the SSE2 and
+// AVX2 kernels give the same results as the scalar one. AVX-512 implies FMA,
+// which the compiler may fuse the products into.
+
+#ifdef VERTEX_KERNELS_X86
+
+#define SSE2_TARGET __attribute__((target("sse2")))
+
+SSE2_TARGET static inline void BroadcastSse2(const glm::mat4 &matrix, __m128 *m)
+{
+  for (int c = 0; c < 4; c++)
+    for (int r = 0; r < 4; r++)
+      m[c*4 + r] = _mm_set1_ps(matrix[c][r]);
+}
+
+SSE2_TARGET static inline void MultiplySse2(const __m128 *m, const __m128 *v, __m128 *out)
+{
+  for (int r = 0; r < 4; r++)
+    out[r] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[r],     v[0]), _mm_mul_ps(m[4 + r],  v[1])),
+                        _mm_add_ps(_mm_mul_ps(m[8 + r], v[2]), _mm_mul_ps(m[12 + r], v[3])));
+}
+
+SSE2_TARGET static inline void LoadSse2(const vec4_soa_t &soa, size_t i, __m128 *v)
+{
+  v[0] = _mm_loadu_ps(soa.x.data() + i);
+  v[1] = _mm_loadu_ps(soa.y.data() + i);
+  v[2] = _mm_loadu_ps(soa.z.data() + i);
+  v[3] = _mm_loadu_ps(soa.w.data() + i);
+}
+
+SSE2_TARGET static inline void StoreSse2(vec4_soa_t *soa, size_t i, const __m128 *v)
+{
+  _mm_storeu_ps(soa->x.data() + i, v[0]);
+  _mm_storeu_ps(soa->y.data() + i, v[1]);
+  _mm_storeu_ps(soa->z.data() + i, v[2]);
+  _mm_storeu_ps(soa->w.data() + i, v[3]);
+}
+
+SSE2_TARGET static inline __m128i OutcodeBitSse2(__m128 mask, int bit)
+{
+  return _mm_and_si128(_mm_castps_si128(mask), _mm_set1_epi32(bit));
+}
+
+SSE2_TARGET static void TransformVerticesSse2(const vertex_transform_t &transform, const vec4_soa_t &positions, const vec4_soa_t &normals,
+                                              size_t first, size_t last, transformed_vertices_t *out)
+{
+  __m128 mvp[16], viewport[16], inverse_projection[16], model_view[16];
+  BroadcastSse2(transform.mvp, mvp);
+  BroadcastSse2(transform.viewport, viewport);
+  BroadcastSse2(transform.inverse_projection, inverse_projection);
+  BroadcastSse2(transform.model_view, model_view);
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 sign = _mm_set1_ps(-0.0f);
+  __m128 guard_band = _mm_set1_ps(transform.guard_band);
+
+  size_t i = first;
+  for (; i + 4 <= last; i += 4)
+  {
+    __m128 p[4], v[4], ndc[4], screen[4], ccs[4], n[4], ccs_n[4];
+    LoadSse2(positions, i, p);
+    MultiplySse2(mvp, p, v);
+
+    __m128 ww = _mm_div_ps(one, v[3]);
+    for (int k = 0; k < 4; k++)
+      ndc[k] = _mm_div_ps(v[k], v[3]);
+    MultiplySse2(viewport, ndc, screen);
+
+    MultiplySse2(inverse_projection, v, ccs);
+    LoadSse2(normals, i, n);
+    MultiplySse2(model_view, n, ccs_n);
+    for (int k = 0; k < 4; k++) {
+      ccs[k] = _mm_mul_ps(ccs[k], ww);
+      ccs_n[k] = _mm_mul_ps(ccs_n[k], ww);
+    }
+
+    StoreSse2(&out->clip_positions, i, v);
+    StoreSse2(&out->screen_positions, i, screen);
+    StoreSse2(&out->ccs_positions, i, ccs);
+    StoreSse2(&out->ccs_normals, i, ccs_n);
+    _mm_storeu_ps(out->ww.data() + i, ww);
+
+    __m128 w = v[3];
+    __m128 neg_w = _mm_xor_ps(w, sign);
+    __m128 band = _mm_mul_ps(guard_band, w);
+    __m128i code = OutcodeBitSse2(_mm_cmplt_ps(v[0], neg_w), CLIP_LEFT);
+    code = _mm_or_si128(code, OutcodeBitSse2(_mm_cmpgt_ps(v[0], w), CLIP_RIGHT));
+    code = _mm_or_si128(code, OutcodeBitSse2(_mm_cmplt_ps(v[1], neg_w), CLIP_BOTTOM));
+    code = _mm_or_si128(code, OutcodeBitSse2(_mm_cmpgt_ps(v[1], w), CLIP_TOP));
+    code = _mm_or_si128(code, OutcodeBitSse2(_mm_cmplt_ps(v[2], neg_w), CLIP_NEAR));
+    code = _mm_or_si128(code, OutcodeBitSse2(_mm_cmpgt_ps(v[2], w), CLIP_FAR));
+    __m128 outside_band = _mm_or_ps(_mm_cmpgt_ps(_mm_andnot_ps(sign, v[0]), band),
+                                    _mm_cmpgt_ps(_mm_andnot_ps(sign, v[1]), band));
+    code = _mm_or_si128(code, OutcodeBitSse2(outside_band, CLIP_GUARD_BAND));
+
+    code = _mm_packs_epi32(code, code);
+    code = _mm_packus_epi16(code, code);
+    int codes = _mm_cvtsi128_si32(code);
+    std::memcpy(out->outcodes.data() + i, &codes, 4);
+  }
+
+  TransformVerticesScalar(transform, positions, normals, i, last, out);
+}
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+AVX2_TARGET static inline void BroadcastAvx2(const glm::mat4 &matrix, __m256 *m)
+{
+  for (int c = 0; c < 4; c++)
+    for (int r = 0; r < 4; r++)
+      m[c*4 + r] = _mm256_set1_ps(matrix[c][r]);
+}
+
+AVX2_TARGET static inline void MultiplyAvx2(const __m256 *m, const __m256 *v, __m256 *out)
+{
+  for (int r = 0; r < 4; r++)
+    out[r] = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[r],     v[0]), _mm256_mul_ps(m[4 + r],  v[1])),
+                           _mm256_add_ps(_mm256_mul_ps(m[8 + r], v[2]), _mm256_mul_ps(m[12 + r], v[3])));
+}
+
+AVX2_TARGET static inline void LoadAvx2(const vec4_soa_t &soa, size_t i, __m256 *v)
+{
+  v[0] = _mm256_loadu_ps(soa.x.data() + i);
+  v[1] = _mm256_loadu_ps(soa.y.data() + i);
+  v[2] = _mm256_loadu_ps(soa.z.data() + i);
+  v[3] = _mm256_loadu_ps(soa.w.data() + i);
+}
+
+AVX2_TARGET static inline void StoreAvx2(vec4_soa_t *soa, size_t i, const __m256 *v)
+{
+  _mm256_storeu_ps(soa->x.data() + i, v[0]);
+  _mm256_storeu_ps(soa->y.data() + i, v[1]);
+  _mm256_storeu_ps(soa->z.data() + i, v[2]);
+  _mm256_storeu_ps(soa->w.data() + i, v[3]);
+}
+
+AVX2_TARGET static inline __m256i OutcodeBitAvx2(__m256 mask, int bit)
+{
+  return _mm256_and_si256(_mm256_castps_si256(mask), _mm256_set1_epi32(bit));
+}
+
+AVX2_TARGET static void TransformVerticesAvx2(const vertex_transform_t &transform, const vec4_soa_t &positions, const vec4_soa_t &normals,
+                                              size_t first, size_t last, transformed_vertices_t *out)
+{
+  __m256 mvp[16], viewport[16], inverse_projection[16], model_view[16];
+  BroadcastAvx2(transform.mvp, mvp);
+  BroadcastAvx2(transform.viewport, viewport);
+  BroadcastAvx2(transform.inverse_projection, inverse_projection);
+  BroadcastAvx2(transform.model_view, model_view);
+  __m256 one = _mm256_set1_ps(1.0f);
+  __m256 sign = _mm256_set1_ps(-0.0f);
+  __m256 guard_band = _mm256_set1_ps(transform.guard_band);
+
+  size_t i = first;
+  for (; i + 8 <= last; i += 8)
+  {
+    __m256 p[4], v[4], ndc[4], screen[4], ccs[4], n[4], ccs_n[4];
+    LoadAvx2(positions, i, p);
+    MultiplyAvx2(mvp, p, v);
+
+    __m256 ww = _mm256_div_ps(one, v[3]);
+    for (int k = 0; k < 4; k++)
+      ndc[k] = _mm256_div_ps(v[k], v[3]);
+    MultiplyAvx2(viewport, ndc, screen);
+
+    MultiplyAvx2(inverse_projection, v, ccs);
+    LoadAvx2(normals, i, n);
+    MultiplyAvx2(model_view, n, ccs_n);
+    for (int k = 0; k < 4; k++) {
+      ccs[k] = _mm256_mul_ps(ccs[k], ww);
+      ccs_n[k] = _mm256_mul_ps(ccs_n[k], ww);
+    }
+
+    StoreAvx2(&out->clip_positions, i, v);
+    StoreAvx2(&out->screen_positions, i, screen);
+    StoreAvx2(&out->ccs_positions, i, ccs);
+    StoreAvx2(&out->ccs_normals, i, ccs_n);
+    _mm256_storeu_ps(out->ww.data() + i, ww);
+
+    __m256 w = v[3];
+    __m256 neg_w = _mm256_xor_ps(w, sign);
+    __m256 band = _mm256_mul_ps(guard_band, w);
+    __m256i code = OutcodeBitAvx2(_mm256_cmp_ps(v[0], neg_w, _CMP_LT_OQ), CLIP_LEFT);
+    code = _mm256_or_si256(code, OutcodeBitAvx2(_mm256_cmp_ps(v[0], w, _CMP_GT_OQ), CLIP_RIGHT));
+    code = _mm256_or_si256(code, OutcodeBitAvx2(_mm256_cmp_ps(v[1], neg_w, _CMP_LT_OQ), CLIP_BOTTOM));
+    code = _mm256_or_si256(code, OutcodeBitAvx2(_mm256_cmp_ps(v[1], w, _CMP_GT_OQ), CLIP_TOP));
+    code = _mm256_or_si256(code, OutcodeBitAvx2(_mm256_cmp_ps(v[2], neg_w, _CMP_LT_OQ), CLIP_NEAR));
+    code = _mm256_or_si256(code, OutcodeBitAvx2(_mm256_cmp_ps(v[2], w, _CMP_GT_OQ), CLIP_FAR));
+    __m256 outside_band = _mm256_or_ps(_mm256_cmp_ps(_mm256_andnot_ps(sign, v[0]), band, _CMP_GT_OQ),
+                                       _mm256_cmp_ps(_mm256_andnot_ps(sign, v[1]), band, _CMP_GT_OQ));
+    code = _mm256_or_si256(code, OutcodeBitAvx2(outside_band, CLIP_GUARD_BAND));
+
+    // the packs work inside 128 bit lanes, so the halves are packed together
+    __m128i codes = _mm_packs_epi32(_mm256_castsi256_si128(code), _mm256_extracti128_si256(code, 1));
+    codes = _mm_packus_epi16(codes, codes);
+    _mm_storel_epi64((__m128i*)(out->outcodes.data() + i), codes);
+  }
+
+  TransformVerticesScalar(transform, positions, normals, i, last, out);
+}
+
+#define AVX512_TARGET __attribute__((target("avx512f")))
+
+AVX512_TARGET static inline void BroadcastAvx512(const glm::mat4 &matrix, __m512 *m)
+{
+  for (int c = 0; c < 4; c++)
+    for (int r = 0; r < 4; r++)
+      m[c*4 + r] = _mm512_set1_ps(matrix[c][r]);
+}
+
+AVX512_TARGET static inline void MultiplyAvx512(const __m512 *m, const __m512 *v, __m512 *out)
+{
+  for (int r = 0; r < 4; r++)
+    out[r] = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(m[r],     v[0]), _mm512_mul_ps(m[4 + r],  v[1])),
+                           _mm512_add_ps(_mm512_mul_ps(m[8 + r], v[2]), _mm512_mul_ps(m[12 + r], v[3])));
+}
+
+AVX512_TARGET static inline void LoadAvx512(const vec4_soa_t &soa, size_t i, __m512 *v)
+{
+  v[0] = _mm512_loadu_ps(soa.x.data() + i);
+  v[1] = _mm512_loadu_ps(soa.y.data() + i);
+  v[2] = _mm512_loadu_ps(soa.z.data() + i);
+  v[3] = _mm512_loadu_ps(soa.w.data() + i);
+}
+
+AVX512_TARGET static inline void StoreAvx512(vec4_soa_t *soa, size_t i, const __m512 *v)
+{
+  _mm512_storeu_ps(soa->x.data() + i, v[0]);
+  _mm512_storeu_ps(soa->y.data() + i, v[1]);
+  _mm512_storeu_ps(soa->z.data() + i, v[2]);
+  _mm512_storeu_ps(soa->w.data() + i, v[3]);
+}
+
+AVX512_TARGET static void TransformVerticesAvx512(const vertex_transform_t &transform, const vec4_soa_t &positions, const vec4_soa_t &normals,
+                                                  size_t first, size_t last, transformed_vertices_t *out)
+{
+  __m512 mvp[16], viewport[16], inverse_projection[16], model_view[16];
+  BroadcastAvx512(transform.mvp, mvp);
+  BroadcastAvx512(transform.viewport, viewport);
+  BroadcastAvx512(transform.inverse_projection, inverse_projection);
+  BroadcastAvx512(transform.model_view, model_view);
+  __m512 one = _mm512_set1_ps(1.0f);
+  __m512 guard_band = _mm512_set1_ps(transform.guard_band);
+
+  size_t i = first;
+  for (; i + 16 <= last; i += 16)
+  {
+    __m512 p[4], v[4], ndc[4], screen[4], ccs[4], n[4], ccs_n[4];
+    LoadAvx512(positions, i, p);
+    MultiplyAvx512(mvp, p, v);
+
+    __m512 ww = _mm512_div_ps(one, v[3]);
+    for (int k = 0; k < 4; k++)
+      ndc[k] = _mm512_div_ps(v[k], v[3]);
+    MultiplyAvx512(viewport, ndc, screen);
+
+    MultiplyAvx512(inverse_projection, v, ccs);
+    LoadAvx512(normals, i, n);
+    MultiplyAvx512(model_view, n, ccs_n);
+    for (int k = 0; k < 4; k++) {
+      ccs[k] = _mm512_mul_ps(ccs[k], ww);
+      ccs_n[k] = _mm512_mul_ps(ccs_n[k], ww);
+    }
+
+    StoreAvx512(&out->clip_positions, i, v);
+    StoreAvx512(&out->screen_positions, i, screen);
+    StoreAvx512(&out->ccs_positions, i, ccs);
+    StoreAvx512(&out->ccs_normals, i, ccs_n);
+    _mm512_storeu_ps(out->ww.data() + i, ww);
+
+    // comparisons give bit masks, each one sets its outcode bit by lane
+    __m512 w = v[3];
+    __m512 neg_w = _mm512_sub_ps(_mm512_setzero_ps(), w);
+    __m512 band = _mm512_mul_ps(guard_band, w);
+    __m512i code = _mm512_setzero_si512();
+    code = _mm512_mask_or_epi32(code, _mm512_cmp_ps_mask(v[0], neg_w, _CMP_LT_OQ), code, _mm512_set1_epi32(CLIP_LEFT));
+    code = _mm512_mask_or_epi32(code, _mm512_cmp_ps_mask(v[0], w, _CMP_GT_OQ), code, _mm512_set1_epi32(CLIP_RIGHT));
+    code = _mm512_mask_or_epi32(code, _mm512_cmp_ps_mask(v[1], neg_w, _CMP_LT_OQ), code, _mm512_set1_epi32(CLIP_BOTTOM));
+    code = _mm512_mask_or_epi32(code, _mm512_cmp_ps_mask(v[1], w, _CMP_GT_OQ), code, _mm512_set1_epi32(CLIP_TOP));
+    code = _mm512_mask_or_epi32(code, _mm512_cmp_ps_mask(v[2], neg_w, _CMP_LT_OQ), code, _mm512_set1_epi32(CLIP_NEAR));
+    code = _mm512_mask_or_epi32(code, _mm512_cmp_ps_mask(v[2], w, _CMP_GT_OQ), code, _mm512_set1_epi32(CLIP_FAR));
+    __mmask16 outside_band = _mm512_cmp_ps_mask(_mm512_abs_ps(v[0]), band, _CMP_GT_OQ)
+                           | _mm512_cmp_ps_mask(_mm512_abs_ps(v[1]), band, _CMP_GT_OQ);
+    code = _mm512_mask_or_epi32(code, outside_band, code, _mm512_set1_epi32(CLIP_GUARD_BAND));
+    _mm512_mask_cvtepi32_storeu_epi8(out->outcodes.data() + i, 0xFFFF, code);
+  }
+
+  TransformVerticesScalar(transform, positions, normals, i, last, out);
+}
+
+#endif // VERTEX_KERNELS_X86
+
+void TransformVertices(int isa, const vertex_transform_t &transform, const vec4_soa_t &positions, const vec4_soa_t &normals,
+                       size_t first, size_t last, transformed_vertices_t *out)
+{
+  if (!VertexIsaSupported(isa))
+    isa = VERTEX_ISA_SCALAR;
+
+  switch (isa)
+  {
+#ifdef VERTEX_KERNELS_X86
+    case VERTEX_ISA_SSE2:
+      TransformVerticesSse2(transform, positions, normals, first, last, out);
+      break;
+    case VERTEX_ISA_AVX2:
+      TransformVerticesAvx2(transform, positions, normals, first, last, out);
+      break;
+    case VERTEX_ISA_AVX512:
+      TransformVerticesAvx512(transform, positions, normals, first, last, out);
+      break;
+#endif
+    default:
+      TransformVerticesScalar(transform, positions, normals, first, last, out);
+  }
+}
+
+double VertexKernelThroughput(int isa, size_t vertex_count, int repeats)
+{
+  vec4_soa_t positions, normals;
+  ResizeSoa(&positions, vertex_count);
+  ResizeSoa(&normals, vertex_count);
+
+  std::mt19937 random(42);
+  std::uniform_real_distribution<float> coordinate(-1.0f, 1.0f);
+  for (size_t i = 0; i < vertex_count; i++) {
+    SoaSet(&positions, i, glm::vec4(coordinate(random), coordinate(random), coordinate(random), 1.0f));
+    SoaSet(&normals, i, glm::vec4(coordinate(random), coordinate(random), coordinate(random), 0.0f));
+  }
+
+  glm::mat4 view = matrices::view_matrix(glm::vec4(0.0f, 0.0f, 3.0f, 1.0f), glm::vec4(0.0f, 0.0f, -1.0f, 0.0f), glm::vec4(0.0f, 1.0f, 0.0f, 0.0f));
+  glm::mat4 projection = matrices::perspective(3.141592f / 3.0f, 3.141592f / 4.0f, 4.0f / 3.0f, 0.1f, 100.0f);
+  vertex_transform_t transform;
+  transform.mvp = projection * view;
+  transform.viewport = matrices::viewport(0, 0, 800, 600);
+  transform.inverse_projection = glm::inverse(projection);
+  transform.model_view = view;
+  transform.guard_band = 4.0f;
+
+  transformed_vertices_t out;
+  ResizeTransformedVertices(&out, vertex_count);
+  TransformVertices(isa, transform, positions, normals, 0, vertex_count, &out); // warm up
+
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < repeats; r++)
+    TransformVertices(isa, transform, positions, normals, 0, vertex_count, &out);
+  std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+  return (double)vertex_count * repeats / seconds.count();
+}
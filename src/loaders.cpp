@@ -1,5 +1,19 @@
 #include "loaders.h"
 
+#include <cctype>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 std::string ReadFileContent(const char* filename)
 {
   std::ifstream file;
@@ -15,4 +29,90 @@ std::string ReadFileContent(const char* filename)
   return file_stream.str();
 }
 
+bool HasExtension(const char* filename, const char* extension)
+{
+  size_t length = strlen(filename);
+  size_t extension_length = strlen(extension);
+  if (length < extension_length)
+    return false;
+  const char *ending = filename + length - extension_length;
+  for (size_t i = 0; i < extension_length; i++)
+    if (tolower((unsigned char)ending[i]) != tolower((unsigned char)extension[i]))
+      return false;
+  return true;
+}
+
+mapped_file_t MapFile(const char* filename)
+{
+  mapped_file_t file;
+#ifdef _WIN32
+  HANDLE handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (handle == INVALID_HANDLE_VALUE) {
+    std::cerr << "ERROR: Cannot open file \"" << filename << "\"." << std::endl;
+    throw std::runtime_error("Error cannot open file");
+  }
+
+  LARGE_INTEGER size;
+  GetFileSizeEx(handle, &size);
+  file.file_handle = handle;
+  file.size = (size_t)size.QuadPart;
+  if (file.size == 0)
+    return file;
+
+  HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+  void *data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+  if (data == NULL) {
+    if (mapping)
+      CloseHandle(mapping);
+    CloseHandle(handle);
+    std::cerr << "ERROR: Cannot map file \"" << filename << "\"." << std::endl;
+    throw std::runtime_error("Error cannot map file");
+  }
+  file.mapping_handle = mapping;
+  file.data = (const char*)data;
+#else
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "ERROR: Cannot open file \"" << filename << "\"." << std::endl;
+    throw std::runtime_error("Error cannot open file");
+  }
+
+  struct stat st;
+  fstat(fd, &st);
+  file.size = (size_t)st.st_size;
+  if (file.size == 0) {
+    close(fd);
+    return file;
+  }
 
+  void *data = mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    std::cerr << "ERROR: Cannot map file \"" << filename << "\"." << std::endl;
+    throw std::runtime_error("Error cannot map file");
+  }
+  madvise(data, file.size, MADV_SEQUENTIAL);
+  file.data = (const char*)data;
+#endif
+  return file;
+}
+
+void UnmapFile(mapped_file_t *file)
+{
+#ifdef _WIN32
+  if (file->data)
+    UnmapViewOfFile(file->data);
+  if (file->mapping_handle)
+    CloseHandle(file->mapping_handle);
+  if (file->file_handle)
+    CloseHandle(file->file_handle);
+  file->file_handle = nullptr;
+  file->mapping_handle = nullptr;
+#else
+  if (file->data)
+    munmap((void*)file->data, file->size);
+#endif
+  file->data = nullptr;
+  file->size = 0;
+}
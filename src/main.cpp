@@ -16,8 +16,11 @@
 #include <stb/stb_image.h>
 
 #include "graphics/model.h"
+#include "graphics/model_loader.h"
+#include "graphics/model_benchmark.h"
 #include "graphics/texture.h"
 #include "graphics/camera.h"
+#include "graphics/vertex_kernels.h"
 #include "input.h"
 #include "scene.h"
 
@@ -26,7 +29,10 @@ Input g_Input;
 OpenGL_Scene g_OpenGLScene;
 Close2GL_Scene g_Close2GLScene;
 scene_state_t g_SceneState;
-model_t g_Model;
+model_ref_t g_Model; // shared read-only with both scenes
+model_ref_t g_LoadedModel; // last model that finished loading, shown again if a preview is dropped
+ModelLoader g_ModelLoader;
+size_t g_PreviewTriangles = 0;
 texture_t g_Texture;
 
 void ErrorCallback(int error, const char* description);
@@ -47,6 +53,10 @@ void UpdateCamera_SeparateControls(double dt);
 void GenerateGUI(double dt);
 
 void OpenObjectFile();
+void FinishOpenObjectFile();
+void UpdateModelPreview();
+void ShowModel(model_ref_t model);
+void FitCameraToModel();
 void OpenImageFile();
 void CenterModel();
 
@@ -79,6 +89,15 @@ struct State_t
 
   char model_filename[512] = "..\\res\\models\\cube.in";
   char texture_filename[512] = "..\\res\\images\\checker_8x8.jpg";
+  float weld_epsilon = 0.0f;
+  bool use_mesh_cache = true;
+  int load_threads = 0;
+  bool progressive_loading = true;
+
+  double vertex_kernel_mverts[VERTEX_ISA_COUNT] = {}; // measured by the benchmark button
+  int synthetic_triangles = 2000000; // size of the synthetic model of the parser benchmark
+  double parser_mbps[2][MODEL_PARSER_COUNT] = {}; // current model and synthetic model, measured by the benchmark button
+  double shading_mode_ms[FLAT_PHONG_SHADING + 1][3] = {}; // Close2GL frame times per shading and lighting mode, measured by the benchmark button
 
   int use_api = USE_OPENGL;
 } State;
@@ -205,6 +224,13 @@ int main( int argc, char* argv[] )
     ImGui_ImplGlfw_NewFrame();
     ImGui::NewFrame();
 
+    if (g_ModelLoader.IsLoading())
+      UpdateModelPreview();
+    if (g_ModelLoader.IsReady())
+      FinishOpenObjectFile();
+    else if (g_Model != g_LoadedModel && !g_ModelLoader.IsLoading() && !g_ModelLoader.IsReady())
+      ShowModel(g_LoadedModel); // the streamed load was cancelled or failed
+
     if (State.model_loaded)
     {
       glm::mat4 view = g_Camera.Camera_View();
@@ -228,6 +254,8 @@ int main( int argc, char* argv[] )
     last_time = curr_time;
   }
   
+  g_ModelLoader.Cancel();
+
   ImGui_ImplOpenGL3_Shutdown();
   ImGui_ImplGlfw_Shutdown();
   ImGui::DestroyContext();
@@ -416,12 +444,43 @@ void GenerateGUI(double dt)
     g_Close2GLScene.Enable(g_SceneState);
 
   ImGui::Checkbox("Debug Colors", &g_SceneState.debug_colors);
+  ImGui::DragFloat("Guard Band", &g_SceneState.guard_band, 0.1f, 1.0f, 64.0f);
+  if (ImGui::InputInt("Raster Threads (0 = all)", &g_SceneState.raster_threads))
+    g_SceneState.raster_threads = std::max(0, g_SceneState.raster_threads);
+
+  ImGui::Dummy(ImVec2(0.0f, 5.0f));
+  ImGui::Text("Vertex Kernels");
+  for (int isa = 0; isa < VERTEX_ISA_COUNT; isa++) {
+    bool supported = VertexIsaSupported(isa);
+    if (!supported)
+      ImGui::BeginDisabled();
+    ImGui::RadioButton(VertexIsaName(isa), &g_SceneState.vertex_isa, isa);
+    if (!supported)
+      ImGui::EndDisabled();
+    if (isa + 1 < VERTEX_ISA_COUNT)
+      ImGui::SameLine();
+  }
+  if (ImGui::Button("Benchmark Vertex Kernels"))
+    for (int isa = 0; isa < VERTEX_ISA_COUNT; isa++)
+      if (VertexIsaSupported(isa))
+        State.vertex_kernel_mverts[isa] = VertexKernelThroughput(isa, 1 << 20, 10) / 1e6;
+  for (int isa = 0; isa < VERTEX_ISA_COUNT; isa++)
+    if (State.vertex_kernel_mverts[isa] > 0.0)
+      ImGui::Text("%s: %.1f Mverts/s", VertexIsaName(isa), State.vertex_kernel_mverts[isa]);
 
   ImGui::Dummy(ImVec2(0.0f, 5.0f));
   ImGui::RadioButton("Points", &g_SceneState.polygon_mode, GL_POINT);
   ImGui::RadioButton("Wireframe", &g_SceneState.polygon_mode, GL_LINE);
   ImGui::RadioButton("Solid", &g_SceneState.polygon_mode, GL_FILL);
 
+  ImGui::Text("Rasterizer");
+  ImGui::RadioButton("Scanline", &g_SceneState.rasterizer, RASTERIZER_SCANLINE);
+  ImGui::SameLine();
+  ImGui::RadioButton("Half-Space", &g_SceneState.rasterizer, RASTERIZER_HALF_SPACE);
+  ImGui::Checkbox("Early Depth Test", &g_SceneState.early_z);
+  ImGui::Checkbox("Visibility Buffer (Half-Space)", &g_SceneState.visibility_buffer);
+  ImGui::Checkbox("Front-to-Back Clusters", &g_SceneState.sort_clusters);
+
   ImGui::Dummy(ImVec2(0.0f, 5.0f));
   ImGui::Separator();
   ImGui::Text("Shading");
@@ -431,6 +490,21 @@ void GenerateGUI(double dt)
   ImGui::RadioButton("None", &g_SceneState.shading_mode, NO_SHADING);
   ImGui::TextWrapped("Special: Phong on Surface (use for phong lighting on the cube)");
   ImGui::RadioButton("Flat Phong", &g_SceneState.shading_mode, FLAT_PHONG_SHADING);
+
+  const int lighting_modes[3] = { AMBIENT_LIGHT, AMBIENT_LIGHT + DIFFUSE_LIGHT, AMBIENT_LIGHT + DIFFUSE_LIGHT + SPECULAR_LIGHT };
+  if (State.model_loaded && State.use_api == USE_CLOSE2GL && ImGui::Button("Benchmark Shading Modes"))
+    for (int mode = NO_SHADING; mode <= FLAT_PHONG_SHADING; mode++)
+      for (int light = 0; light < 3; light++) {
+        scene_state_t state = g_SceneState;
+        state.shading_mode = mode;
+        state.lighting_mode = lighting_modes[light];
+        State.shading_mode_ms[mode][light] = g_Close2GLScene.RasterTime(state, g_Camera.Camera_View(), g_Camera.Camera_Projection(), 10);
+      }
+  const char *shading_names[] = { "None", "Flat", "Gouraud", "Phong", "Flat Phong" };
+  for (int mode = NO_SHADING; mode <= FLAT_PHONG_SHADING; mode++)
+    if (State.shading_mode_ms[mode][0] > 0.0)
+      ImGui::Text("%s: A %.2f, AD %.2f, ADS %.2f ms/frame", shading_names[mode], 
+          State.shading_mode_ms[mode][0], State.shading_mode_ms[mode][1], State.shading_mode_ms[mode][2]);
   
   ImGui::Dummy(ImVec2(0.0f, 5.0f));
   ImGui::RadioButton("Lights Off", &g_SceneState.lighting_mode, AMBIENT_LIGHT);
@@ -442,16 +516,9 @@ void GenerateGUI(double dt)
   ImGui::Dummy(ImVec2(0.0f, 5.0f));
   ImGui::Checkbox("Backface Culling", &g_SceneState.face_culling);
 
-  int last_face = g_SceneState.front_face;
   ImGui::Text("Orientation");
   ImGui::RadioButton("CW", &g_SceneState.front_face, GL_CW); ImGui::SameLine();
   ImGui::RadioButton("CCW", &g_SceneState.front_face, GL_CCW);
-  if (State.model_loaded && last_face != g_SceneState.front_face) {
-    CalculateNormals(&g_Model, g_SceneState.front_face == GL_CCW);
-    g_Close2GLScene.SetModel(g_Model);
-    g_OpenGLScene.LoadModelToScene(g_SceneState, g_Model);
-    CenterModel();
-  }
   
   int last_n = g_SceneState.use_calculated_normals;
   int last_raw = g_SceneState.use_raw_normals;
@@ -528,9 +595,43 @@ void GenerateGUI(double dt)
 
   ImGui::Dummy(ImVec2(0.0f, 5.0f));
   ImGui::InputText("File Path", State.model_filename, IM_ARRAYSIZE(State.model_filename));
+  ImGui::InputFloat("Weld Epsilon", &State.weld_epsilon, 0.0f, 0.0f, "%.6f");
+  ImGui::Checkbox("Use Mesh Cache", &State.use_mesh_cache);
+  ImGui::InputInt("Load Threads (0 = all)", &State.load_threads);
+  State.load_threads = std::max(State.load_threads, 0);
+  ImGui::Checkbox("Show Model While Loading", &State.progressive_loading);
   if (ImGui::Button("Open model"))
     OpenObjectFile();
 
+  ImGui::InputInt("Synthetic Triangles", &State.synthetic_triangles);
+  State.synthetic_triangles = std::max(State.synthetic_triangles, 2);
+  if (ImGui::Button("Benchmark Model Parsers")) {
+    const char *synthetic_filename = "synthetic_benchmark.in";
+    try {
+      WriteSyntheticModelFile(synthetic_filename, State.synthetic_triangles);
+      for (int parser = 0; parser < MODEL_PARSER_COUNT; parser++) {
+        State.parser_mbps[0][parser] = ModelParserThroughput(parser, State.model_filename, 3);
+        State.parser_mbps[1][parser] = ModelParserThroughput(parser, synthetic_filename, 1);
+      }
+    } catch ( std::exception& e ) {
+      std::cerr << "ERROR: Parser benchmark failed: " << e.what() << std::endl;
+    }
+    std::remove(synthetic_filename);
+  }
+  for (int parser = 0; parser < MODEL_PARSER_COUNT; parser++) {
+    if (State.parser_mbps[0][parser] > 0.0)
+      ImGui::Text("%s, this model: %.1f MB/s", ModelParserName(parser), State.parser_mbps[0][parser]);
+    if (State.parser_mbps[1][parser] > 0.0)
+      ImGui::Text("%s, synthetic: %.1f MB/s", ModelParserName(parser), State.parser_mbps[1][parser]);
+  }
+  if (g_ModelLoader.IsLoading()) {
+    ImGui::ProgressBar(g_ModelLoader.Progress(), ImVec2(-1.0f, 0.0f), g_ModelLoader.StageName());
+    if (ImGui::Button("Cancel loading"))
+      g_ModelLoader.Cancel();
+  } else if (g_ModelLoader.HasFailed()) {
+    ImGui::TextWrapped("Failed to load model: %s", g_ModelLoader.error.c_str());
+  }
+
   ImGui::InputInt("level", &g_SceneState.filter_level);
   ImGui::Dummy(ImVec2(0.0f, 10.0f));
   State.close = ImGui::Button("Close");
@@ -543,7 +644,7 @@ void CenterModel()
   g_OpenGLScene.model_matrix   = glm::mat4(1.0f);
   g_Close2GLScene.model_matrix = glm::mat4(1.0f);
 
-  glm::vec3 bbox_center = (g_Model.bounding_box_max + g_Model.bounding_box_min) / 2.0f;
+  glm::vec3 bbox_center = (g_Model->bounding_box_max + g_Model->bounding_box_min) / 2.0f;
   g_OpenGLScene.model_matrix *= glm::translate(-bbox_center);
   g_OpenGLScene.bounding_box_max -= bbox_center;
   g_OpenGLScene.bounding_box_min -= bbox_center;
@@ -554,35 +655,95 @@ void CenterModel()
 
 void OpenObjectFile()
 {
-  try {
-    g_Model = ReadModelFile(State.model_filename);
-    CalculateNormals(&g_Model, g_SceneState.front_face == GL_CCW);
-    g_Close2GLScene.SetModel(g_Model);
-    g_OpenGLScene.LoadModelToScene(g_SceneState, g_Model);
-    
-    CenterModel();
+  model_load_options_t options;
+  options.weld_epsilon = State.weld_epsilon;
+  options.use_mesh_cache = State.use_mesh_cache;
+  options.thread_count = State.load_threads;
+  options.ccw_face = g_SceneState.front_face == GL_CCW;
+  g_PreviewTriangles = 0;
+  g_ModelLoader.Start(State.model_filename, options, glfwGetTime(), State.progressive_loading);
+}
 
-    g_SceneState.gui_object_color[0] = g_Model.materials[0].diffuse[0];
-    g_SceneState.gui_object_color[1] = g_Model.materials[0].diffuse[1];
-    g_SceneState.gui_object_color[2] = g_Model.materials[0].diffuse[2];
-    g_SceneState.gui_object_color[3] = 1.0f;
+// Shows the triangles read so far. The preview grows in place, so only the
+// new triangles are uploaded to OpenGL and Close2GL is handed the model 
+// again to gather them. The full model replaces it when loading finishes.
+void UpdateModelPreview()
+{
+  model_ref_t preview = g_ModelLoader.TakeBatches();
+  if (!preview)
+    return;
 
-    float bbox_size = std::max(
-      (g_Model.bounding_box_max.x - g_Model.bounding_box_min.x) * 2.0f,
-      (g_Model.bounding_box_max.y - g_Model.bounding_box_min.y) * 2.0f
-    ) / 2.0f;
-    float distance = bbox_size / std::tan(g_Camera.h_fov / 2.0f);
+  g_Model = preview;
+  g_Close2GLScene.SetModel(g_Model);
+  if (g_PreviewTriangles == 0)
+    g_OpenGLScene.ReserveModelInScene(g_SceneState, g_Model, g_ModelLoader.total_triangles);
+  g_OpenGLScene.AppendModelToScene(g_SceneState, g_Model, g_PreviewTriangles);
+  CenterModel();
+
+  if (g_PreviewTriangles == 0) {
+    g_SceneState.gui_object_color[0] = g_Model->materials[0].diffuse[0];
+    g_SceneState.gui_object_color[1] = g_Model->materials[0].diffuse[1];
+    g_SceneState.gui_object_color[2] = g_Model->materials[0].diffuse[2];
+    g_SceneState.gui_object_color[3] = 1.0f;
+    FitCameraToModel();
+    State.model_loaded = true;
+  }
+  g_PreviewTriangles = g_Model->triangles.size();
+}
 
-    State.camera_initial_position = glm::vec3(0.0f, 0.0f, distance);
-    g_Camera.position = State.camera_initial_position;
+void FinishOpenObjectFile()
+{
+  try {
+    model_t model = g_ModelLoader.TakeModel();
 
-    State.camera_initial_farplane = distance * 2.0f;
-    g_Camera.farplane = State.camera_initial_farplane;
+    if (!model.has_calculated_normals)
+      CalculateNormals(&model, g_SceneState.front_face == GL_CCW, State.load_threads);
 
-    State.model_loaded = true;
+    g_LoadedModel = std::make_shared<model_t>(std::move(model));
   } catch ( std::exception& e ) {
-    
+    // Drop the preview, if any, and keep showing the previous model
+    if (g_Model != g_LoadedModel)
+      ShowModel(g_LoadedModel);
+    return;
   }
+  ShowModel(g_LoadedModel);
+}
+
+// Replaces the model of both scenes, or hides the current one when model
+// is empty
+void ShowModel(model_ref_t model)
+{
+  g_Model = model;
+  g_PreviewTriangles = 0;
+  g_Close2GLScene.SetModel(g_Model);
+  State.model_loaded = g_Model != nullptr;
+  if (!g_Model)
+    return;
+
+  g_OpenGLScene.LoadModelToScene(g_SceneState, g_Model);
+  CenterModel();
+
+  g_SceneState.gui_object_color[0] = g_Model->materials[0].diffuse[0];
+  g_SceneState.gui_object_color[1] = g_Model->materials[0].diffuse[1];
+  g_SceneState.gui_object_color[2] = g_Model->materials[0].diffuse[2];
+  g_SceneState.gui_object_color[3] = 1.0f;
+
+  FitCameraToModel();
+}
+
+void FitCameraToModel()
+{
+  float bbox_size = std::max(
+    (g_Model->bounding_box_max.x - g_Model->bounding_box_min.x) * 2.0f,
+    (g_Model->bounding_box_max.y - g_Model->bounding_box_min.y) * 2.0f
+  ) / 2.0f;
+  float distance = bbox_size / std::tan(g_Camera.h_fov / 2.0f);
+
+  State.camera_initial_position = glm::vec3(0.0f, 0.0f, distance);
+  g_Camera.position = State.camera_initial_position;
+
+  State.camera_initial_farplane = distance * 2.0f;
+  g_Camera.farplane = State.camera_initial_farplane;
 }
 
 void OpenImageFile()
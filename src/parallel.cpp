@@ -0,0 +1,162 @@
+#include "parallel.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// One ParallelFor call running on the pool
+typedef struct
+{
+  const std::function<void(size_t index, int thread)> *task;
+  size_t count;
+  int thread_count;
+  std::atomic<size_t> next_index;
+  std::atomic<int> next_thread;
+  std::exception_ptr error;
+  std::mutex error_mutex;
+} parallel_job_t;
+
+// Workers stay alive between calls, so loops that run every frame do not
+// pay for starting threads. Only one loop uses the pool at a time.
+typedef struct thread_pool_t
+{
+  std::mutex owner_mutex; // held by the thread whose loop is on the pool
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  std::vector<std::thread> workers;
+  parallel_job_t *job = nullptr;
+  unsigned long generation = 0;
+  int pending = 0; // workers that have not finished the current job
+  bool shutdown = false;
+
+  ~thread_pool_t()
+  {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->shutdown = true;
+    }
+    this->wake.notify_all();
+    for (std::thread &worker : this->workers)
+      worker.join();
+  }
+} thread_pool_t;
+
+static thread_pool_t g_Pool;
+
+// Set on the pool workers and on the thread that owns the pool while its
+// loop runs, so a nested ParallelFor never waits on the pool it runs on
+static thread_local bool t_OnPool = false;
+
+int HardwareThreadCount()
+{
+  unsigned int count = std::thread::hardware_concurrency();
+  return count > 0 ? (int)count : 1;
+}
+
+static void RunJob(parallel_job_t *job, int thread)
+{
+  size_t count = job->count;
+  for (size_t i = job->next_index++; i < count; i = job->next_index++) {
+    try {
+      (*job->task)(i, thread);
+    } catch ( ... ) {
+      std::lock_guard<std::mutex> lock(job->error_mutex);
+      if (!job->error)
+        job->error = std::current_exception();
+      job->next_index = count;
+    }
+  }
+}
+
+static void PoolWorker()
+{
+  t_OnPool = true;
+  unsigned long seen = 0;
+  std::unique_lock<std::mutex> lock(g_Pool.mutex);
+  while (true) {
+    g_Pool.wake.wait(lock, [&] { return g_Pool.shutdown || g_Pool.generation != seen; });
+    if (g_Pool.shutdown)
+      return;
+    seen = g_Pool.generation;
+    parallel_job_t *job = g_Pool.job;
+    lock.unlock();
+
+    // workers beyond the thread count of the loop sit this one out
+    int thread = job->next_thread++;
+    if (thread < job->thread_count)
+      RunJob(job, thread);
+
+    lock.lock();
+    if (--g_Pool.pending == 0)
+      g_Pool.done.notify_one();
+  }
+}
+
+// Used when the pool is taken, by another thread or by a task that calls
+// ParallelFor itself
+static void RunOnNewThreads(parallel_job_t *job)
+{
+  std::vector<std::thread> threads;
+  for (int t = 1; t < job->thread_count; t++)
+    threads.emplace_back(RunJob, job, t);
+  RunJob(job, 0);
+  for (std::thread &t : threads)
+    t.join();
+}
+
+static void RunOnPool(parallel_job_t *job)
+{
+  std::unique_lock<std::mutex> lock(g_Pool.mutex);
+  while ((int)g_Pool.workers.size() < job->thread_count - 1)
+    g_Pool.workers.emplace_back(PoolWorker);
+
+  g_Pool.job = job;
+  g_Pool.pending = g_Pool.workers.size();
+  g_Pool.generation++;
+  lock.unlock();
+  g_Pool.wake.notify_all();
+
+  RunJob(job, 0);
+
+  lock.lock();
+  g_Pool.done.wait(lock, [] { return g_Pool.pending == 0; });
+  g_Pool.job = nullptr;
+}
+
+void ParallelFor(size_t count, int thread_count, const std::function<void(size_t index, int thread)> &task)
+{
+  if (thread_count <= 0)
+    thread_count = HardwareThreadCount();
+  if ((size_t)thread_count > count)
+    thread_count = (int)count;
+
+  if (thread_count <= 1) {
+    for (size_t i = 0; i < count; i++)
+      task(i, 0);
+    return;
+  }
+
+  parallel_job_t job;
+  job.task = &task;
+  job.count = count;
+  job.thread_count = thread_count;
+  job.next_index = 0;
+  job.next_thread = 1;
+
+  std::unique_lock<std::mutex> owner;
+  if (!t_OnPool)
+    owner = std::unique_lock<std::mutex>(g_Pool.owner_mutex, std::try_to_lock);
+  if (owner.owns_lock()) {
+    t_OnPool = true;
+    RunOnPool(&job);
+    t_OnPool = false;
+  } else {
+    RunOnNewThreads(&job);
+  }
+
+  if (job.error)
+    std::rethrow_exception(job.error);
+}
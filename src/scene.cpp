@@ -1,4 +1,7 @@
 #include "scene.h"
+#include "parallel.h"
+
+#include <chrono>
 
 void SuperScene::DrawScene()
 {
@@ -14,11 +17,36 @@ void SuperScene::DrawScene()
 
 /* ==================== OpenGL ====================== */
 
-void OpenGL_Scene::LoadModelToScene(scene_state_t state, model_t model)
+void OpenGL_Scene::LoadModelToScene(scene_state_t state, model_ref_t model)
+{
+  this->ReserveModelInScene(state, model, model->triangles.size());
+  this->AppendModelToScene(state, model, 0);
+}
+
+static GLuint CreateAttributeBuffer(GLuint location, GLint number_of_dimensions, size_t size)
+{
+  GLuint VBO_id;
+  glCreateBuffers(1, &VBO_id);
+  glBindBuffer(GL_ARRAY_BUFFER, VBO_id);
+  glBufferData(GL_ARRAY_BUFFER, size * sizeof(GL_FLOAT), NULL, GL_DYNAMIC_DRAW);
+  glVertexAttribPointer(location, number_of_dimensions, GL_FLOAT, GL_FALSE, 0, 0);
+  glEnableVertexAttribArray(location);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  return VBO_id;
+}
+
+static void FillAttributeBuffer(GLuint VBO_id, size_t offset, const std::vector<float> &data)
+{
+  glBindBuffer(GL_ARRAY_BUFFER, VBO_id);
+  glBufferSubData(GL_ARRAY_BUFFER, offset * sizeof(GL_FLOAT), data.size() * sizeof(GL_FLOAT), data.data());
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void OpenGL_Scene::ReserveModelInScene(scene_state_t state, model_ref_t model, size_t triangle_count)
 {
-  if (!this->vao_id) {
-    GLuint bufs[3] = { this->vbo_model_id, this->vbo_normal_id, this->vbo_surface_normal_id };
-    glDeleteBuffers(3, bufs);
+  if (this->vao_id) {
+    GLuint bufs[4] = { this->vbo_model_id, this->vbo_normal_id, this->vbo_surface_normal_id, this->vbo_texture_coords_id };
+    glDeleteBuffers(4, bufs);
     glDeleteVertexArrays(1, &this->vao_id);
   }
 
@@ -26,80 +54,58 @@ void OpenGL_Scene::LoadModelToScene(scene_state_t state, model_t model)
   glGenVertexArrays(1, &vertex_array_object_id);
   glBindVertexArray(vertex_array_object_id);
 
-  std::vector<float> vertices = ExtractVertices(model);
+  this->model            = model;
+  this->model_matrix     = glm::mat4(1.0f);
+  this->bounding_box_max = model->bounding_box_max;
+  this->bounding_box_min = model->bounding_box_min;
+  this->name             = model->model_name;
+  this->vertex_count     = 0;
+  this->rendering_mode   = GL_TRIANGLES;
+  this->vao_id           = vertex_array_object_id;
+  this->has_texture      = model->has_texture;
+  this->calculated_ccw   = model->calculated_ccw;
+
+  // buffers are sized for the whole model and filled as triangles arrive
+  size_t corner_count = 3 * triangle_count;
+  this->vbo_model_id          = CreateAttributeBuffer(0, 4, 4 * corner_count);
+  this->vbo_normal_id         = CreateAttributeBuffer(1, 4, 4 * corner_count);
+  this->vbo_surface_normal_id = CreateAttributeBuffer(2, 4, 4 * corner_count);
+  this->vbo_texture_coords_id = model->has_texture ? CreateAttributeBuffer(3, 2, 2 * corner_count) : 0;
+
+  glBindVertexArray(0);
+}
+
+// model is the one in the scene grown by the triangles from first_triangle
+void OpenGL_Scene::AppendModelToScene(scene_state_t state, model_ref_t model_ref, size_t first_triangle)
+{
+  this->model = model_ref;
+  const model_t &model = *model_ref;
+
+  std::vector<float> vertices = ExtractVertices(model, first_triangle);
   std::vector<float> normals, surface_normals;
   if (state.use_raw_normals) {
-    normals = model.raw_normals;
-    surface_normals = ExtractSurfaceNormals(model);
+    normals = ExtractRawNormals(model, first_triangle);
+    surface_normals = ExtractSurfaceNormals(model, first_triangle);
   } else
   if (state.use_calculated_normals) {
-    normals = ExtractCalculatedNormals(model);
-    surface_normals = ExtractCalculatedSurfaceNormals(model);
+    normals = ExtractCalculatedNormals(model, first_triangle);
+    surface_normals = ExtractCalculatedSurfaceNormals(model, first_triangle);
   } else {
-    normals = ExtractNormals(model);
-    surface_normals = ExtractSurfaceNormals(model);
+    normals = ExtractNormals(model, first_triangle);
+    surface_normals = ExtractSurfaceNormals(model, first_triangle);
   }
 
-  this->model_matrix     = glm::mat4(1.0f);
   this->bounding_box_max = model.bounding_box_max;
   this->bounding_box_min = model.bounding_box_min;
-  this->name             = model.model_name;
-  this->vertex_count     = vertices.size() / 4;
-  this->rendering_mode   = GL_TRIANGLES;
-  this->vao_id           = vertex_array_object_id;
-  
-  GLint  number_of_dimensions = 4;
-  GLuint location = 0;
-  GLuint VBO_model_coefficients_id;
-  glCreateBuffers(1, &VBO_model_coefficients_id);
-  glBindBuffer(GL_ARRAY_BUFFER, VBO_model_coefficients_id);
-  glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GL_FLOAT), NULL, GL_DYNAMIC_DRAW);
-  glBufferSubData(GL_ARRAY_BUFFER, 0, vertices.size() * sizeof(GL_FLOAT), vertices.data());
-  glVertexAttribPointer(location, number_of_dimensions, GL_FLOAT, GL_FALSE, 0, 0);
-  glEnableVertexAttribArray(location);
-  glBindBuffer(GL_ARRAY_BUFFER, 0);
-  this->vbo_model_id = VBO_model_coefficients_id;
 
-  location = 1;
-  number_of_dimensions = 4;
-  GLuint VBO_normal_coefficients_id;
-  glCreateBuffers(1, &VBO_normal_coefficients_id);
-  glBindBuffer(GL_ARRAY_BUFFER, VBO_normal_coefficients_id);
-  glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(GL_FLOAT), NULL, GL_DYNAMIC_DRAW);
-  glBufferSubData(GL_ARRAY_BUFFER, 0, normals.size() * sizeof(GL_FLOAT), normals.data());
-  glVertexAttribPointer(location, number_of_dimensions, GL_FLOAT, GL_FALSE, 0, 0);
-  glEnableVertexAttribArray(location);
-  glBindBuffer(GL_ARRAY_BUFFER, 0);
-  this->vbo_normal_id = VBO_normal_coefficients_id;
-
-  location = 2;
-  number_of_dimensions = 4;
-  GLuint VBO_surface_normal_coefficients_id;
-  glCreateBuffers(1, &VBO_surface_normal_coefficients_id);
-  glBindBuffer(GL_ARRAY_BUFFER, VBO_surface_normal_coefficients_id);
-  glBufferData(GL_ARRAY_BUFFER, surface_normals.size() * sizeof(GL_FLOAT), NULL, GL_DYNAMIC_DRAW);
-  glBufferSubData(GL_ARRAY_BUFFER, 0, surface_normals.size() * sizeof(GL_FLOAT), surface_normals.data());
-  glVertexAttribPointer(location, number_of_dimensions, GL_FLOAT, GL_FALSE, 0, 0);
-  glEnableVertexAttribArray(location);
-  glBindBuffer(GL_ARRAY_BUFFER, 0);
-  this->vbo_surface_normal_id = VBO_surface_normal_coefficients_id;
-
-  if (model.has_texture) {
-    std::vector<float> texcoords = ExtractTextureCoords(model);
-    location = 3;
-    number_of_dimensions = 2;
-    GLuint VBO_texture_coords_coefficients_id;
-    glCreateBuffers(1, &VBO_texture_coords_coefficients_id);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO_texture_coords_coefficients_id);
-    glBufferData(GL_ARRAY_BUFFER, texcoords.size() * sizeof(GL_FLOAT), NULL, GL_DYNAMIC_DRAW);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, texcoords.size() * sizeof(GL_FLOAT), texcoords.data());
-    glVertexAttribPointer(location, number_of_dimensions, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(location);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    this->vbo_texture_coords_id = VBO_texture_coords_coefficients_id;
-  }
+  size_t offset = 3 * first_triangle;
+  FillAttributeBuffer(this->vbo_model_id, 4 * offset, vertices);
+  FillAttributeBuffer(this->vbo_normal_id, 4 * offset, normals);
+  FillAttributeBuffer(this->vbo_surface_normal_id, 4 * offset, surface_normals);
+  if (this->has_texture)
+    FillAttributeBuffer(this->vbo_texture_coords_id, 2 * offset, ExtractTextureCoords(model, first_triangle));
 
-  glBindVertexArray(0);
+  this->vertex_count = offset + vertices.size() / 4;
 }
 
 void OpenGL_Scene::LoadTextureToScene(scene_state_t state, texture_t tex)
@@ -158,6 +164,7 @@ void OpenGL_Scene::Render(scene_state_t state, glm::mat4 view_matrix, glm::mat4
   glUniform1i(this->shader.lighting_uniform, state.lighting_mode);
   glUniform1i(this->shader.texture_uniform, 1);
   glUniform1i(this->shader.has_texture_uniform, state.enable_texture);
+  glUniform1f(this->shader.normal_sign_uniform, NormalSign(state, this->calculated_ccw));
 
   this->DrawScene();
 }
@@ -240,7 +247,7 @@ void Close2GL_Scene::Render(scene_state_t state, glm::mat4 view_matrix, glm::mat
 
   this->TransformModel(state, view_matrix, projection_matrix, viewport_map);
   
-  this->Rasterize(state, view_matrix, projection_matrix, viewport_map);
+  this->Rasterize(state);
         
   glBindTexture(GL_TEXTURE_2D, this->texture_id);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
@@ -265,9 +272,13 @@ void Close2GL_Scene::New_Frame()
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 }
 
-void Close2GL_Scene::SetModel(model_t model)
+// Also called again with the same model when a streamed preview grew, so
+// the caches are always gathered again
+void Close2GL_Scene::SetModel(model_ref_t model)
 {
   this->model = model;
+  this->vertex_cache.source = nullptr;
+  this->cluster_order.source = nullptr;
 }
 
 void Close2GL_Scene::SetMipmap(texture_t *mipmaps)
@@ -296,109 +307,316 @@ void Close2GL_Scene::ResizeBuffers(scene_state_t state)
 
 
 
+// Milliseconds per frame of Close2GL transforming and rasterizing the model,
+// drawn into the color and depth buffers
+double Close2GL_Scene::RasterTime(scene_state_t state, glm::mat4 view_matrix, glm::mat4 projection_matrix, int frames)
+{
+  glm::mat4 viewport_map = matrices::viewport(0, 0, state.screen_width, state.screen_height);
+  auto start = std::chrono::steady_clock::now();
+  for (int frame = 0; frame < frames; frame++) {
+    for (int i = 0; i < this->buffer_size; i++) {
+      this->color_buffer[i] = black;
+      this->depth_buffer[i] = std::numeric_limits<float>::infinity();
+    }
+    this->TransformModel(state, view_matrix, projection_matrix, viewport_map);
+    this->Rasterize(state);
+  }
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / frames;
+}
+
 /* ==================== Close2GL PRIVATE ====================== */
 
 void Close2GL_Scene::TransformModel(scene_state_t state, glm::mat4 view_matrix, glm::mat4 projection_matrix, glm::mat4 viewport_matrix)
 {
   this->triangles.clear();
+  if (!this->model)
+    return;
 
-  glm::mat4 mvp = projection_matrix * view_matrix * this->model_matrix;
+  const model_t &model = *this->model;
 
-  std::vector<model_triangle_t> model_triangles = this->model.triangles;
-  std::vector<glm::vec4> model_vertices= this->model.vertices;
+  this->model_view_matrix = view_matrix * this->model_matrix;
+  this->inverse_projection_matrix = glm::inverse(projection_matrix);
+  this->viewport_matrix = viewport_matrix;
 
-  int vertex_index = 0;
-  for (glm::vec4 &v : model_vertices) 
-  {
-    v = mvp * v;
-    if (v.w <= 0.0) {
-      EraseTriangleWithVertex(&model_triangles, vertex_index);
-      vertex_index++;
-      continue;
-    }
+  this->TransformVertices(state, projection_matrix * view_matrix * this->model_matrix);
 
-    glm::vec4 ndc_v = v / v.w;
-    if (std::abs(ndc_v.x) > 1.0f || std::abs(ndc_v.y) > 1.0f || std::abs(ndc_v.z) > 1.0f) {
-      EraseTriangleWithVertex(&model_triangles, vertex_index);
-      vertex_index++;
-      continue;
-    }
+  glm::vec4 color = glm::vec4(state.gui_object_color[0], state.gui_object_color[1], state.gui_object_color[2], state.gui_object_color[3]);
+  float normal_sign = NormalSign(state, model.calculated_ccw);
 
-    vertex_index++;
+  if (!state.sort_clusters) {
+    for (const model_triangle_t &model_triangle : model.triangles)
+      this->SetupModelTriangle(state, model_triangle, color, normal_sign);
+    return;
   }
 
-  glm::vec4 color = glm::vec4(state.gui_object_color[0], state.gui_object_color[1], state.gui_object_color[2], state.gui_object_color[3]);
+  this->SortClusters();
+  for (unsigned int cluster : this->cluster_order.order) {
+    size_t first = (size_t)cluster * CLUSTER_SIZE;
+    size_t last = std::min(first + CLUSTER_SIZE, model.triangles.size());
+    for (size_t i = first; i < last; i++)
+      this->SetupModelTriangle(state, model.triangles[i], color, normal_sign);
+  }
+}
+
+void Close2GL_Scene::SetupModelTriangle(scene_state_t state, const model_triangle_t &model_triangle, glm::vec4 color, float normal_sign)
+{
+  const model_t &model = *this->model;
+  const transformed_vertices_t &transformed = this->vertex_cache.transformed;
   glm::vec4 debug_colors[3] = { glm::vec4(1.0, 0.0, 0.0, 1.0), glm::vec4(0.0, 1.0, 0.0, 1.0), glm::vec4(0.0, 0.0, 1.0, 1.0) };
 
-  for (model_triangle_t model_triangle : model_triangles) {
+  unsigned char c0 = transformed.outcodes[model_triangle.indices[0]];
+  unsigned char c1 = transformed.outcodes[model_triangle.indices[1]];
+  unsigned char c2 = transformed.outcodes[model_triangle.indices[2]];
 
-    triangle_t t;
+  // all corners outside the same plane: trivially rejected
+  if (c0 & c1 & c2 & CLIP_FRUSTUM)
+    return;
 
-    glm::vec4 v0 = model_vertices[model_triangle.indices[0]];
-    glm::vec4 v1 = model_vertices[model_triangle.indices[1]];
-    glm::vec4 v2 = model_vertices[model_triangle.indices[2]];
+  glm::vec4 colors[3];
+  for (int i = 0; i < 3; i++) {
+    if (state.debug_colors)
+      colors[i] = debug_colors[i];
+    else
+    if (state.enable_texture && model.has_texture) 
+      colors[i] = glm::vec4(model_triangle.tex_coords[2*i], model_triangle.tex_coords[2*i+1], 1.0f, 1.0f);
+    else
+      colors[i] = color;
+  }
 
-    t.vertices[0] = v0;
-    t.vertices[1] = v1;
-    t.vertices[2] = v2;
+  glm::vec4 face_normal;
+  if (state.use_calculated_normals && !state.use_raw_normals)
+    face_normal = normal_sign * model_triangle.calculated_face_normal;
+  else
+    face_normal = model_triangle.face_normal;
 
-    t.mapped_vertices[0] = viewport_matrix * (v0 / v0.w);
-    t.mapped_vertices[1] = viewport_matrix * (v1 / v1.w);
-    t.mapped_vertices[2] = viewport_matrix * (v2 / v2.w);
-    
-    if (state.face_culling)
-    {
-      bool is_front_facing = FaceCulling(t.mapped_vertices, state.front_face);
-      if (!is_front_facing)
-        continue;
-    }
+  unsigned char crossed = (c0 | c1 | c2) & CLIP_GEOMETRIC;
+  if (!crossed) {
+    this->SetupCachedTriangle(state, model_triangle, colors, face_normal);
+    return;
+  }
 
-    if (state.use_raw_normals) {
-      int i0 = 4 * model_triangle.indices[0];
-      int i1 = 4 * model_triangle.indices[1];
-      int i2 = 4 * model_triangle.indices[2];
-      
-      t.normals[0] = glm::vec4(model.raw_normals[i0], model.raw_normals[i0+1], model.raw_normals[i0+2], model.raw_normals[i0+3]);
-      t.normals[1] = glm::vec4(model.raw_normals[i1], model.raw_normals[i1+1], model.raw_normals[i1+2], model.raw_normals[i1+3]);
-      t.normals[2] = glm::vec4(model.raw_normals[i2], model.raw_normals[i2+1], model.raw_normals[i2+2], model.raw_normals[i2+3]);
+  // Only the near and far planes and the guard band are clipped against.
+  // Triangles that cross the screen edges inside the guard band are left 
+  // whole and scissored by the rasterizer.
+  clip_vertex_t corners[CLIP_MAX_VERTICES];
+  for (int i = 0; i < 3; i++) {
+    int index = model_triangle.indices[i];
+    corners[i].position = SoaAt(transformed.clip_positions, index);
+    corners[i].normal = SoaAt(this->vertex_cache.normals, index);
+    corners[i].texture_coords = glm::vec2(model_triangle.tex_coords[2*i], model_triangle.tex_coords[2*i+1]);
+    corners[i].color = colors[i];
+  }
+
+  int count = ClipPolygon(corners, 3, crossed, state.guard_band);
+  for (int i = 1; i + 1 < count; i++) {
+    clip_vertex_t fan[3] = { corners[0], corners[i], corners[i+1] };
+    this->SetupTriangle(state, fan, face_normal);
+  }
+}
+
+// Orders the clusters of CLUSTER_SIZE consecutive triangles nearest first, 
+// by the view depth of their centroids. Consecutive triangles of a mesh file
+// are usually close together, so a cluster is a small piece of surface. The
+// order is kept until the camera moves or turns noticeably.
+void Close2GL_Scene::SortClusters()
+{
+  const model_t &model = *this->model;
+  cluster_order_t &clusters = this->cluster_order;
+  size_t count = (model.triangles.size() + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+
+  if (clusters.source != &model) {
+    clusters.centroids.assign(count, glm::vec4(0.0f));
+    for (size_t i = 0; i < model.triangles.size(); i++)
+      for (int v = 0; v < 3; v++)
+        clusters.centroids[i / CLUSTER_SIZE] += model.vertices[model.triangles[i].indices[v]];
+    for (glm::vec4 &centroid : clusters.centroids) // w counted the corners
+      centroid /= centroid.w;
+    clusters.source = &model;
+    clusters.valid = false;
+  }
+
+  glm::mat4 camera = glm::inverse(this->model_view_matrix);
+  glm::vec3 eye = glm::vec3(camera * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+  glm::vec3 forward = glm::normalize(glm::vec3(camera * glm::vec4(0.0f, 0.0f, -1.0f, 0.0f)));
+  float size = glm::length(model.bounding_box_max - model.bounding_box_min);
+  if (clusters.valid && glm::length(eye - clusters.eye) <= CLUSTER_REORDER_DISTANCE * size
+      && glm::dot(forward, clusters.forward) >= CLUSTER_REORDER_COS)
+    return;
+
+  // depth quantized to 16 bits, enough to order pieces of surface
+  std::vector<float> &depths = clusters.depths;
+  depths.resize(count);
+  float min_depth = std::numeric_limits<float>::max(), max_depth = -std::numeric_limits<float>::max();
+  for (size_t c = 0; c < count; c++) {
+    depths[c] = -(this->model_view_matrix * clusters.centroids[c]).z;
+    min_depth = std::min(min_depth, depths[c]);
+    max_depth = std::max(max_depth, depths[c]);
+  }
+  float scale = max_depth > min_depth ? 65535.0f / (max_depth - min_depth) : 0.0f;
+  std::vector<unsigned short> &keys = clusters.keys;
+  keys.resize(count);
+  for (size_t c = 0; c < count; c++)
+    keys[c] = (unsigned short)((depths[c] - min_depth) * scale);
+
+  // two stable 8 bit counting passes, low byte first
+  clusters.order.resize(count);
+  clusters.scratch.resize(count);
+  for (size_t c = 0; c < count; c++)
+    clusters.order[c] = c;
+  for (int shift = 0; shift < 16; shift += 8) {
+    size_t offsets[257] = { 0 };
+    for (size_t c = 0; c < count; c++)
+      offsets[((keys[c] >> shift) & 0xFF) + 1]++;
+    for (int b = 0; b < 256; b++)
+      offsets[b+1] += offsets[b];
+    for (unsigned int c : clusters.order)
+      clusters.scratch[offsets[(keys[c] >> shift) & 0xFF]++] = c;
+    clusters.order.swap(clusters.scratch);
+  }
+
+  clusters.eye = eye;
+  clusters.forward = forward;
+  clusters.valid = true;
+}
+
+// Copies the model into the SoA layout of the kernels. The normals in use 
+// are chosen here, already flipped to the front face.
+void Close2GL_Scene::GatherVertices(scene_state_t state)
+{
+  const model_t &model = *this->model;
+  vertex_cache_t &cache = this->vertex_cache;
+  size_t count = model.vertices.size();
+
+  int normal_source = state.use_raw_normals ? 0 : (state.use_calculated_normals ? 1 : 2);
+  float normal_sign = NormalSign(state, model.calculated_ccw);
+
+  bool model_changed = cache.source != &model;
+  if (!model_changed && cache.normal_source == normal_source && cache.normal_sign == normal_sign)
+    return;
+
+  if (model_changed) {
+    ResizeSoa(&cache.positions, count);
+    for (size_t i = 0; i < count; i++)
+      SoaSet(&cache.positions, i, model.vertices[i]);
+    ResizeTransformedVertices(&cache.transformed, count);
+  }
 
-      t.face_normal = model_triangle.face_normal;
+  ResizeSoa(&cache.normals, count);
+  for (size_t i = 0; i < count; i++)
+  {
+    glm::vec4 normal(0.0f);
+    if (normal_source == 0) {
+      size_t r = 4 * i;
+      if (r + 3 < model.raw_normals.size())
+        normal = glm::vec4(model.raw_normals[r], model.raw_normals[r+1], model.raw_normals[r+2], model.raw_normals[r+3]);
     } else
-    if (state.use_calculated_normals) {
-      t.normals[0] = model.calculated_normals[model_triangle.indices[0]];
-      t.normals[1] = model.calculated_normals[model_triangle.indices[1]];
-      t.normals[2] = model.calculated_normals[model_triangle.indices[2]];
-
-      t.face_normal = model_triangle.calculated_face_normal;
-    } else {
-      t.normals[0] = model.normals[model_triangle.indices[0]];
-      t.normals[1] = model.normals[model_triangle.indices[1]];
-      t.normals[2] = model.normals[model_triangle.indices[2]];
-
-      t.face_normal = model_triangle.face_normal;
-    }
+    if (normal_source == 1)
+      normal = normal_sign * model.calculated_normals[i];
+    else
+      normal = model.normals[i];
+    SoaSet(&cache.normals, i, normal);
+  }
+
+  cache.source = &model;
+  cache.source_vertices = count;
+  cache.normal_source = normal_source;
+  cache.normal_sign = normal_sign;
+}
 
-    for (int i = 0; i < 3; i++) {
-      if (state.enable_texture && model.has_texture) 
-        color = glm::vec4(model_triangle.tex_coords[2*i], model_triangle.tex_coords[2*i+1], 1.0f, 1.0f);
+// Everything a vertex needs is computed once here, the triangles only 
+// gather it by index
+void Close2GL_Scene::TransformVertices(scene_state_t state, glm::mat4 mvp)
+{
+  this->GatherVertices(state);
+
+  vertex_transform_t transform;
+  transform.mvp = mvp;
+  transform.viewport = this->viewport_matrix;
+  transform.inverse_projection = this->inverse_projection_matrix;
+  transform.model_view = this->model_view_matrix;
+  transform.guard_band = state.guard_band;
 
-      t.attrs[i].ww = 1.0f / t.vertices[i].w;
+  vertex_cache_t &cache = this->vertex_cache;
+  ::TransformVertices(state.vertex_isa, transform, cache.positions, cache.normals, 0, cache.source_vertices, &cache.transformed);
+}
 
-      t.attrs[i].ccs_position = (glm::inverse(projection_matrix) * t.vertices[i]) * t.attrs[i].ww;
-      t.attrs[i].ccs_normal = (view_matrix * model_matrix * t.normals[i]) * t.attrs[i].ww;
+void Close2GL_Scene::SetupCachedTriangle(scene_state_t state, const model_triangle_t &model_triangle, glm::vec4 *colors, glm::vec4 face_normal)
+{
+  const vertex_cache_t &cache = this->vertex_cache;
+  const transformed_vertices_t &transformed = cache.transformed;
+  triangle_t t;
 
-      t.attrs[i].texture_coords.x = model_triangle.tex_coords[2*i];
-      t.attrs[i].texture_coords.y = model_triangle.tex_coords[2*i+1];
-      t.attrs[i].texture_coords *= t.attrs[i].ww;
+  for (int i = 0; i < 3; i++) {
+    t.vertices[i] = SoaAt(transformed.clip_positions, model_triangle.indices[i]);
+    t.mapped_vertices[i] = SoaAt(transformed.screen_positions, model_triangle.indices[i]);
+  }
 
-      glm::vec4 c = state.debug_colors ? debug_colors[i] : color;
-      t.attrs[i].color = c * t.attrs[i].ww; 
-      t.attrs[i].flatColor = c;
-      t.attrs[i].flatCcsNormal = view_matrix * model_matrix * t.face_normal;
-    }
+  if (state.face_culling)
+  {
+    bool is_front_facing = FaceCulling(t.mapped_vertices, state.front_face);
+    if (!is_front_facing)
+      return;
+  }
+
+  t.face_normal = face_normal;
+  glm::vec4 flat_ccs_normal = this->model_view_matrix * face_normal;
+
+  for (int i = 0; i < 3; i++) {
+    int index = model_triangle.indices[i];
+    float ww = transformed.ww[index];
+    t.normals[i] = SoaAt(cache.normals, index);
+
+    t.attrs[i].ww = ww;
+    t.attrs[i].ccs_position = SoaAt(transformed.ccs_positions, index);
+    t.attrs[i].ccs_normal = SoaAt(transformed.ccs_normals, index);
+    t.attrs[i].texture_coords = glm::vec2(model_triangle.tex_coords[2*i], model_triangle.tex_coords[2*i+1]) * ww;
+
+    t.attrs[i].color = colors[i] * ww; 
+    t.attrs[i].flatColor = colors[i];
+    t.attrs[i].flatCcsNormal = flat_ccs_normal;
+  }
+
+  this->triangles.push_back(t);
+}
+
+// Clipped triangles have new vertices that are not in the cache, so they 
+// are set up from their interpolated clip space attributes
+void Close2GL_Scene::SetupTriangle(scene_state_t state, clip_vertex_t *corners, glm::vec4 face_normal)
+{
+  triangle_t t;
+
+  for (int i = 0; i < 3; i++) {
+    t.vertices[i] = corners[i].position;
+    t.mapped_vertices[i] = this->viewport_matrix * (corners[i].position / corners[i].position.w);
+  }
+  
+  if (state.face_culling)
+  {
+    bool is_front_facing = FaceCulling(t.mapped_vertices, state.front_face);
+    if (!is_front_facing)
+      return;
+  }
+
+  t.face_normal = face_normal;
+  glm::vec4 flat_ccs_normal = this->model_view_matrix * face_normal;
+
+  for (int i = 0; i < 3; i++) {
+    t.normals[i] = corners[i].normal;
 
-    this->triangles.push_back(t);
+    t.attrs[i].ww = 1.0f / t.vertices[i].w;
+
+    t.attrs[i].ccs_position = (this->inverse_projection_matrix * t.vertices[i]) * t.attrs[i].ww;
+    t.attrs[i].ccs_normal = (this->model_view_matrix * t.normals[i]) * t.attrs[i].ww;
+
+    t.attrs[i].texture_coords = corners[i].texture_coords * t.attrs[i].ww;
+
+    t.attrs[i].color = corners[i].color * t.attrs[i].ww; 
+    t.attrs[i].flatColor = corners[i].color;
+    t.attrs[i].flatCcsNormal = flat_ccs_normal;
   }
+
+  this->triangles.push_back(t);
 }
 
 glm::vec4 Close2GL_Scene::Nearest(glm::vec2 texture_coord, int level)
@@ -456,10 +674,11 @@ glm::vec4 Close2GL_Scene::Trilinear(glm::vec2 texture_coord, glm::vec2 delta_tex
   return color;
 }
 
-glm::vec4 Close2GL_Scene::GetTextureColor(scene_state_t state, glm::vec2 texture_coord, glm::vec2 delta_tex)
+template <int TEXTURE>
+glm::vec4 Close2GL_Scene::GetTextureColor(const scene_state_t &state, glm::vec2 texture_coord, glm::vec2 delta_tex)
 {
   glm::vec4 color;
-  switch (state.texture_filter)
+  switch (TEXTURE)
   {
     case GL_LINEAR:
       color = this->Bilinear(texture_coord, 0);
@@ -476,7 +695,8 @@ glm::vec4 Close2GL_Scene::GetTextureColor(scene_state_t state, glm::vec2 texture
   return color;
 }
 
-glm::vec4 WalkEdge(edge_t edge, int incr)
+template <int LAYOUT>
+glm::vec4 WalkEdge(const edge_t<LAYOUT> &edge, int incr)
 {
   glm::vec4 step = edge.vertex_top;
   step.y = step.y + incr;
@@ -486,223 +706,736 @@ glm::vec4 WalkEdge(edge_t edge, int incr)
   return step;
 }
 
-glm::vec4 Close2GL_Scene::ProcessFragment(scene_state_t state, interpolating_attr_t *attr, int x, int y, interpolating_attr_t flatAttr)
+template <int SHADING, int LIGHTING, int TEXTURE>
+glm::vec4 Close2GL_Scene::ProcessFragment(const scene_state_t &state, pipeline_varyings_t<SHADING, LIGHTING, TEXTURE> *attr, const pipeline_varyings_t<SHADING, LIGHTING, TEXTURE> &flatAttr, glm::vec2 delta_tex)
 {
+  float ww = attr->ww;
   glm::vec4 color;
-  if (state.enable_texture && model.has_texture && !std::isnan(this->delta_tex.x / attr->ww))
+  if (TEXTURE != PIPELINE_UNTEXTURED && !std::isnan(delta_tex.x / ww))
   {
-    color = this->GetTextureColor(state, attr->texture_coords / attr->ww, this->delta_tex / attr->ww);
-    switch (state.shading_mode)
+    color = this->GetTextureColor<TEXTURE>(state, TextureCoords(*attr) / ww, delta_tex / ww);
+    switch (SHADING)
     {
       case FLAT_SHADING:
-        color = color * (flatAttr.flatColorAmbient) 
-            + color * (flatAttr.flatColorDiffuse) 
-            + (flatAttr.flatColorSpecular);
+        color = color * Varying<VARYING_FLAT_TERMS>(flatAttr, 0) 
+            + color * Varying<VARYING_FLAT_TERMS>(flatAttr, 1) 
+            + Varying<VARYING_FLAT_TERMS>(flatAttr, 2);
         break;
         
       case PHONG_SHADING:
-        color = LightingWithTextureMapping(state, *attr, color, attr->ccs_normal/attr->ww);
+        color = Lighting<LIGHTING>(color, Varying<VARYING_CCS_NORMAL>(*attr)/ww, Varying<VARYING_CCS_POSITION>(*attr));
         break;
 
       case FLAT_PHONG_SHADING:
-        color = LightingWithTextureMapping(state, *attr, color, flatAttr.flatCcsNormal);
+        color = Lighting<LIGHTING>(color, Varying<VARYING_FLAT_NORMAL>(flatAttr), Varying<VARYING_CCS_POSITION>(*attr));
         break;
         
       case GOURAUD_SHADING:
-        color = color * (attr->vColorAmbient/attr->ww) 
-            + color * (attr->vColorDiffuse/attr->ww) 
-            + (attr->vColorSpecular/attr->ww);
+        color = color * (Varying<VARYING_GOURAUD_TERMS>(*attr, 0)/ww) 
+            + color * (Varying<VARYING_GOURAUD_TERMS>(*attr, 1)/ww) 
+            + (Varying<VARYING_GOURAUD_TERMS>(*attr, 2)/ww);
         break;
     }
   }
   else
-    switch (state.shading_mode)
+    switch (SHADING)
     {
       case FLAT_SHADING:
-        color = flatAttr.flatColor;
+        color = Varying<VARYING_FLAT_COLOR>(flatAttr);
         break;
 
       case PHONG_SHADING:
       case FLAT_PHONG_SHADING:
-        Shading(state, attr);
+        Shading<SHADING, LIGHTING>(attr);
+        [[fallthrough]];
 
       case GOURAUD_SHADING:
       case NO_SHADING:
       default:
-        color = attr->color / attr->ww;
+        color = Varying<VARYING_COLOR>(*attr) / ww;
     }
   return glm::pow(color, glm::vec4(1.0)/2.2f);
 }
 
-void Close2GL_Scene::Rasterize(scene_state_t state, glm::mat4 view_matrix, glm::mat4 projection_matrix, glm::mat4 viewport_matrix)
+void Close2GL_Scene::Rasterize(const scene_state_t &state)
+{
+  this->BinTriangles(state);
+  if (state.visibility_buffer)
+    this->visibility.resize(this->buffer_size);
+
+  this->RasterTiles(state);
+}
+
+// Picks the pipeline instantiation once per draw, so the per vertex and 
+// per pixel code has no branches on the shading mode, the lights or the 
+// texture filter
+void Close2GL_Scene::RasterTiles(const scene_state_t &state)
 {
-  for (triangle_t t : this->triangles)
+  switch (state.shading_mode)
   {
-    for (int a = 0; a < 3; a++) {
-      if (state.shading_mode != NO_SHADING)
-        Shading(state, &(t.attrs[a]));
-      if (state.shading_mode == FLAT_SHADING) {
-        t.attrs[a].flatColor = t.attrs[0].flatColor;
-        t.attrs[a].flatCcsNormal = t.attrs[0].flatCcsNormal;
-      }
-      if (state.enable_texture && this->model.has_texture) {
-        if (state.shading_mode == FLAT_SHADING) {
-          int lighting = state.lighting_mode;
-          glm::vec4 specular_term = glm::vec4(0.0,0.0,0.0,1.0);
-          if (lighting >= SPECULAR_LIGHT) {
-            lighting -= SPECULAR_LIGHT;
-            specular_term = SpecularLighting(
-                t.attrs[0].flatCcsNormal, 
-                t.attrs[a].ccs_position / t.attrs[a].ww);
-          }
+    case FLAT_SHADING:
+      this->RasterTiles<FLAT_SHADING>(state);
+      break;
 
-          glm::vec4 diffuse_term = glm::vec4(0.0,0.0,0.0,1.0);
-          if (lighting >= DIFFUSE_LIGHT) {
-            lighting -= DIFFUSE_LIGHT;
-            diffuse_term = DiffuseLighting(glm::vec4(1.0,1.0,1.0,1.0), 
-                t.attrs[0].flatCcsNormal,
-                t.attrs[a].ccs_position / t.attrs[a].ww);
-          }
-          
-          glm::vec4 ambient_term = glm::vec4(0.0,0.0,0.0,1.0);
-          if (lighting >= AMBIENT_LIGHT) {
-            lighting -= AMBIENT_LIGHT;
-            ambient_term = glm::vec4(0.2, 0.2, 0.2, 1.0);
-          }
+    case GOURAUD_SHADING:
+      this->RasterTiles<GOURAUD_SHADING>(state);
+      break;
 
-          t.attrs[a].flatColorAmbient = ambient_term;
-          t.attrs[a].flatColorDiffuse = diffuse_term;
-          t.attrs[a].flatColorSpecular = specular_term;
-        }
-        if (state.shading_mode == GOURAUD_SHADING) {
-          int lighting = state.lighting_mode;
-          glm::vec4 specular_term = glm::vec4(0.0);
-          if (lighting >= SPECULAR_LIGHT) {
-            lighting -= SPECULAR_LIGHT;
-            specular_term = SpecularLighting(
-                t.attrs[a].ccs_normal / t.attrs[a].ww, 
-                t.attrs[a].ccs_position / t.attrs[a].ww);
-          }
+    case PHONG_SHADING:
+      this->RasterTiles<PHONG_SHADING>(state);
+      break;
 
-          glm::vec4 diffuse_term = glm::vec4(0.0);
-          if (lighting >= DIFFUSE_LIGHT) {
-            lighting -= DIFFUSE_LIGHT;
-            diffuse_term = DiffuseLighting(glm::vec4(1.0), 
-                t.attrs[a].ccs_normal / t.attrs[a].ww,
-                t.attrs[a].ccs_position / t.attrs[a].ww);
-          }
-          
-          glm::vec4 ambient_term = glm::vec4(0.0);
-          if (lighting >= AMBIENT_LIGHT) {
-            lighting -= AMBIENT_LIGHT;
-            ambient_term = glm::vec4(0.2);
-          }
+    case FLAT_PHONG_SHADING:
+      this->RasterTiles<FLAT_PHONG_SHADING>(state);
+      break;
 
-          t.attrs[a].vColorAmbient = ambient_term * t.attrs[a].ww;
-          t.attrs[a].vColorDiffuse = diffuse_term * t.attrs[a].ww;
-          t.attrs[a].vColorSpecular = specular_term * t.attrs[a].ww;
-        }
+    case NO_SHADING:
+    default:
+      this->RasterTiles<NO_SHADING>(state);
+  }
+}
+
+template <int SHADING>
+void Close2GL_Scene::RasterTiles(const scene_state_t &state)
+{
+  // unlit draws read no light, one instantiation serves every mode
+  if constexpr (SHADING == NO_SHADING)
+    this->RasterTiles<SHADING, AMBIENT_LIGHT>(state);
+  else
+    switch (PipelineLighting(state))
+    {
+      case AMBIENT_LIGHT:
+        this->RasterTiles<SHADING, AMBIENT_LIGHT>(state);
+        break;
+
+      case AMBIENT_LIGHT + DIFFUSE_LIGHT:
+        this->RasterTiles<SHADING, AMBIENT_LIGHT + DIFFUSE_LIGHT>(state);
+        break;
+
+      default:
+        this->RasterTiles<SHADING, AMBIENT_LIGHT + DIFFUSE_LIGHT + SPECULAR_LIGHT>(state);
+    }
+}
+
+template <int SHADING, int LIGHTING>
+void Close2GL_Scene::RasterTiles(const scene_state_t &state)
+{
+  switch (PipelineTexture(state, this->model && this->model->has_texture))
+  {
+    case GL_NEAREST:
+      this->RasterTiles<SHADING, LIGHTING, GL_NEAREST>(state);
+      break;
+
+    case GL_LINEAR:
+      this->RasterTiles<SHADING, LIGHTING, GL_LINEAR>(state);
+      break;
+
+    case GL_LINEAR_MIPMAP_LINEAR:
+      this->RasterTiles<SHADING, LIGHTING, GL_LINEAR_MIPMAP_LINEAR>(state);
+      break;
+
+    default:
+      this->RasterTiles<SHADING, LIGHTING, PIPELINE_UNTEXTURED>(state);
+  }
+}
+
+template <int SHADING, int LIGHTING, int TEXTURE>
+void Close2GL_Scene::RasterTiles(const scene_state_t &state)
+{
+  // the buffer is only allocated again when the layout changes
+  typedef std::vector<pipeline_varyings_t<SHADING, LIGHTING, TEXTURE>> varyings_buffer_t;
+  varyings_buffer_t *varyings = std::any_cast<varyings_buffer_t>(&this->triangle_varyings);
+  if (varyings == nullptr)
+    varyings = &this->triangle_varyings.emplace<varyings_buffer_t>();
+  varyings->resize(3 * this->triangles.size());
+  pipeline_varyings_t<SHADING, LIGHTING, TEXTURE> *attrs = varyings->data();
+
+  // vertex setup, once per triangle instead of once per tile
+  size_t block_count = (this->triangles.size() + RASTER_BLOCK_SIZE - 1) / RASTER_BLOCK_SIZE;
+  ParallelFor(block_count, state.raster_threads, [&](size_t block, int thread) {
+    size_t first = block * RASTER_BLOCK_SIZE;
+    size_t last = std::min(first + RASTER_BLOCK_SIZE, this->triangles.size());
+    for (size_t i = first; i < last; i++)
+      this->ShadeVertices<SHADING, LIGHTING, TEXTURE>(this->triangles[i], &attrs[3 * i]);
+  });
+
+  // Each tile only writes its own pixels and draws its triangles in the
+  // order they were submitted, so every pixel sees the same fragments in
+  // the same order no matter how many threads run
+  ParallelFor(this->tile_bins.size(), state.raster_threads, [&](size_t tile, int thread) {
+    int column = tile % this->tile_columns;
+    int row = tile / this->tile_columns;
+    tile_rect_t rect;
+    rect.x0 = column * TILE_SIZE;
+    rect.y0 = row * TILE_SIZE;
+    rect.x1 = std::min(rect.x0 + TILE_SIZE, state.screen_width);
+    rect.y1 = std::min(rect.y0 + TILE_SIZE, state.screen_height);
+
+    bool half_space = state.rasterizer == RASTERIZER_HALF_SPACE && state.polygon_mode == GL_FILL;
+    bool deferred = half_space && state.visibility_buffer;
+    if (deferred)
+      for (int y = rect.y0; y < rect.y1; y++)
+        for (int x = rect.x0; x < rect.x1; x++)
+          this->visibility[this->PixelIndex(state, x, y)].triangle = VISIBILITY_EMPTY;
+
+    for (unsigned int t : this->tile_bins[tile])
+      if (half_space)
+        this->RasterTriangleHalfSpace<SHADING, LIGHTING, TEXTURE>(state, t, &attrs[3 * t], rect);
+      else
+        this->RasterTriangle<SHADING, LIGHTING, TEXTURE>(state, this->triangles[t], &attrs[3 * t], rect);
+
+    if (deferred)
+      this->ResolveVisibility<SHADING, LIGHTING, TEXTURE>(state, attrs, rect);
+  });
+}
+
+// Lights the vertices of t and packs what the fragments of the pipeline
+// key read into attrs
+template <int SHADING, int LIGHTING, int TEXTURE>
+void Close2GL_Scene::ShadeVertices(const triangle_t &t, pipeline_varyings_t<SHADING, LIGHTING, TEXTURE> *attrs)
+{
+  vertex_attr_t vertex[3] = { t.attrs[0], t.attrs[1], t.attrs[2] };
+  for (int a = 0; a < 3; a++) {
+    Shading<SHADING, LIGHTING>(&vertex[a]);
+    if (SHADING == FLAT_SHADING) {
+      vertex[a].flatColor = vertex[0].flatColor;
+      vertex[a].flatCcsNormal = vertex[0].flatCcsNormal;
+    }
+
+    pipeline_varyings_t<SHADING, LIGHTING, TEXTURE> *attr = &attrs[a];
+    attr->ww = vertex[a].ww;
+    SetVarying<VARYING_COLOR>(attr, vertex[a].color);
+    SetVarying<VARYING_CCS_POSITION>(attr, vertex[a].ccs_position);
+    SetVarying<VARYING_CCS_NORMAL>(attr, vertex[a].ccs_normal);
+    SetTextureCoords(attr, vertex[a].texture_coords);
+    SetVarying<VARYING_FLAT_COLOR>(attr, vertex[a].flatColor);
+    SetVarying<VARYING_FLAT_NORMAL>(attr, vertex[a].flatCcsNormal);
+
+    if (TEXTURE != PIPELINE_UNTEXTURED) {
+      if (SHADING == FLAT_SHADING) {
+        glm::vec4 specular_term = glm::vec4(0.0,0.0,0.0,1.0);
+        if (LIGHTING & SPECULAR_LIGHT)
+          specular_term = SpecularLighting(
+              vertex[0].flatCcsNormal, 
+              vertex[a].ccs_position / vertex[a].ww);
+
+        glm::vec4 diffuse_term = glm::vec4(0.0,0.0,0.0,1.0);
+        if (LIGHTING & DIFFUSE_LIGHT)
+          diffuse_term = DiffuseLighting(glm::vec4(1.0,1.0,1.0,1.0), 
+              vertex[0].flatCcsNormal,
+              vertex[a].ccs_position / vertex[a].ww);
+        
+        glm::vec4 ambient_term = glm::vec4(0.0,0.0,0.0,1.0);
+        if (LIGHTING & AMBIENT_LIGHT)
+          ambient_term = glm::vec4(0.2, 0.2, 0.2, 1.0);
+
+        SetVarying<VARYING_FLAT_TERMS>(attr, ambient_term, 0);
+        SetVarying<VARYING_FLAT_TERMS>(attr, diffuse_term, 1);
+        SetVarying<VARYING_FLAT_TERMS>(attr, specular_term, 2);
       }
+      if (SHADING == GOURAUD_SHADING) {
+        glm::vec4 specular_term = glm::vec4(0.0);
+        if (LIGHTING & SPECULAR_LIGHT)
+          specular_term = SpecularLighting(
+              vertex[a].ccs_normal / vertex[a].ww, 
+              vertex[a].ccs_position / vertex[a].ww);
+
+        glm::vec4 diffuse_term = glm::vec4(0.0);
+        if (LIGHTING & DIFFUSE_LIGHT)
+          diffuse_term = DiffuseLighting(glm::vec4(1.0), 
+              vertex[a].ccs_normal / vertex[a].ww,
+              vertex[a].ccs_position / vertex[a].ww);
+        
+        glm::vec4 ambient_term = glm::vec4(0.0);
+        if (LIGHTING & AMBIENT_LIGHT)
+          ambient_term = glm::vec4(0.2);
+
+        SetVarying<VARYING_GOURAUD_TERMS>(attr, ambient_term * vertex[a].ww, 0);
+        SetVarying<VARYING_GOURAUD_TERMS>(attr, diffuse_term * vertex[a].ww, 1);
+        SetVarying<VARYING_GOURAUD_TERMS>(attr, specular_term * vertex[a].ww, 2);
+      }
+    }
+  }
+}
+
+// Adds every triangle to the tiles its screen bounds touch. The bounds grow 
+// by RASTER_MARGIN because the walk rounds positions to whole pixels.
+void Close2GL_Scene::BinTriangles(const scene_state_t &state)
+{
+  this->tile_columns = (state.screen_width + TILE_SIZE - 1) / TILE_SIZE;
+  this->tile_rows = (state.screen_height + TILE_SIZE - 1) / TILE_SIZE;
+  this->tile_bins.resize(this->tile_columns * this->tile_rows);
+  for (std::vector<unsigned int> &bin : this->tile_bins)
+    bin.clear();
+
+  for (size_t i = 0; i < this->triangles.size(); i++)
+  {
+    const glm::vec4 *v = this->triangles[i].mapped_vertices;
+    float min_x = std::min(v[0].x, std::min(v[1].x, v[2].x)) - RASTER_MARGIN;
+    float max_x = std::max(v[0].x, std::max(v[1].x, v[2].x)) + RASTER_MARGIN;
+    float min_y = std::min(v[0].y, std::min(v[1].y, v[2].y)) - RASTER_MARGIN;
+    float max_y = std::max(v[0].y, std::max(v[1].y, v[2].y)) + RASTER_MARGIN;
+    if (max_x < 0.0f || max_y < 0.0f || min_x >= state.screen_width || min_y >= state.screen_height)
+      continue;
+
+    int first_column = std::max(0, (int)min_x / TILE_SIZE);
+    int last_column  = std::min(this->tile_columns - 1, (int)max_x / TILE_SIZE);
+    int first_row    = std::max(0, (int)min_y / TILE_SIZE);
+    int last_row     = std::min(this->tile_rows - 1, (int)max_y / TILE_SIZE);
+    for (int row = first_row; row <= last_row; row++)
+      for (int column = first_column; column <= last_column; column++)
+        this->tile_bins[row * this->tile_columns + column].push_back(i);
+  }
+}
+
+template <int SHADING, int LIGHTING, int TEXTURE>
+void Close2GL_Scene::RasterTriangle(const scene_state_t &state, const triangle_t &t, const pipeline_varyings_t<SHADING, LIGHTING, TEXTURE> *attrs, tile_rect_t rect)
+{
+  edge_t<VaryingsLayout(SHADING, LIGHTING, TEXTURE)> found_edges[3], edges[3];
+  for (int e = 0; e < 3; e++)
+  {
+    int next_e = (e+1) % 3;
+    found_edges[e] = FindEdge(
+      t.mapped_vertices[e],      attrs[e],
+      t.mapped_vertices[next_e], attrs[next_e]);
+  }
+  
+  OrderEdges(found_edges, edges);
+  
+  int active_edge = 1;
+  int max_inc = std::round(edges[0].vertex_delta.y);
+
+  int y, x;
+  glm::vec4 p_a, p_b;
+  pipeline_varyings_t<SHADING, LIGHTING, TEXTURE> attr_a, attr_b;
+  for (int inc_y = 0; inc_y < max_inc; inc_y++)
+  {
+    if (inc_y > 0 && active_edge == 1 && p_b.y > edges[1].vertex_bottom.y)
+      active_edge = 2;
+
+    int inc0 = inc_y;
+    int inc1 = inc_y;  
+    if (active_edge == 2)
+      inc1 -= edges[1].vertex_delta.y;
+
+    p_a = WalkEdge(edges[0], inc0);
+    p_b = WalkEdge(edges[active_edge], inc1);
+
+    bool flat_edge = std::abs(edges[active_edge].vertex_delta.y) < 0.5f;
+
+    // rows that cannot reach this tile are skipped, the margin covers the
+    // rounding of every fragment in the row
+    float row_min_x = std::min(p_a.x, p_b.x), row_max_x = std::max(p_a.x, p_b.x);
+    if (flat_edge) {
+      row_min_x = std::min(row_min_x, std::min(edges[active_edge].vertex_top.x, edges[active_edge].vertex_bottom.x));
+      row_max_x = std::max(row_max_x, std::max(edges[active_edge].vertex_top.x, edges[active_edge].vertex_bottom.x));
+    }
+    if (std::max(p_a.y, p_b.y) + RASTER_MARGIN < rect.y0 || std::min(p_a.y, p_b.y) - RASTER_MARGIN >= rect.y1
+        || row_max_x + RASTER_MARGIN < rect.x0 || row_min_x - RASTER_MARGIN >= rect.x1)
+      continue;
+
+    attr_a = Interpolate(edges[0].bottom, edges[0].top, 0, max_inc, inc0);
+    attr_b = Interpolate(edges[active_edge].bottom, edges[active_edge].top, 0, edges[active_edge].vertex_delta.y, inc1);
+
+    glm::vec2 delta_tex = (TextureCoords(attr_b) - TextureCoords(attr_a));
+    if (std::abs(p_b.x - p_a.x) > 0.0)
+      delta_tex /= std::abs(p_b.x - p_a.x);
+    delta_tex.x = std::abs(delta_tex.x);
+    delta_tex.y = std::abs(delta_tex.y);
+
+    // ARESTA PRINCIPAL
+    y = std::round(p_a.y);
+    x = std::round(p_a.x);
+  
+    // Phong shading lights attr_a in place and the fill starts from it, so
+    // those edge fragments are shaded in every tile the row reaches, even
+    // off screen, and only ever get the late depth test
+    constexpr bool lit_in_place = SHADING == PHONG_SHADING || SHADING == FLAT_PHONG_SHADING;
+    glm::vec4 color;
+    if (lit_in_place || InsideRect(rect, x, y)) {
+      color = this->ProcessFragment<SHADING, LIGHTING, TEXTURE>(state, &attr_a, attrs[0], delta_tex);
+      if (InsideRect(rect, x, y))
+        this->ChangeBuffer(state, x, y, p_a.z, vec4_to_rgba(color));
     }
 
-    edge_t* edges = new edge_t[3];
-    for (int e = 0; e < 3; e++)
+    // ARESTA SECUNDÁRIA
+    y = std::round(p_b.y);
+    x = std::round(p_b.x);
+
+    if (flat_edge)
     {
-      int next_e = (e+1) % 3;
-      edges[e] = FindEdge(
-        t.mapped_vertices[e],      t.attrs[e],
-        t.mapped_vertices[next_e], t.attrs[next_e]);
+      scanline_t<VaryingsLayout(SHADING, LIGHTING, TEXTURE)> sl = FindScanline(
+          edges[active_edge].vertex_top,    edges[active_edge].top, 
+          edges[active_edge].vertex_bottom, edges[active_edge].bottom);
+      this->RasterScanline<SHADING, LIGHTING, TEXTURE>(state, sl, rect, delta_tex);
+    }
+
+    if (lit_in_place || InsideRect(rect, x, y)) {
+      color = this->ProcessFragment<SHADING, LIGHTING, TEXTURE>(state, &attr_b, attrs[0], delta_tex);
+      if (InsideRect(rect, x, y))
+        this->ChangeBuffer(state, x, y, p_b.z, vec4_to_rgba(color));
     }
     
-    edges = OrderEdges(edges);
-    
-    int active_edge = 1;
-    int max_inc = std::round(edges[0].vertex_delta.y);
+    // PREENCHIMENTO
+    if (state.polygon_mode == GL_FILL)
+    {
+      float my = (p_a.y + p_b.y) / 2.0f;
+      p_a.y = my;
+      p_b.y = my;
+      scanline_t<VaryingsLayout(SHADING, LIGHTING, TEXTURE)> sl = FindScanline(p_a, attr_a, p_b, attr_b);
+      this->RasterScanline<SHADING, LIGHTING, TEXTURE>(state, sl, rect, delta_tex);
+    }
+  }
+}
+
+// Fills the pixels of rect whose centers are inside the triangle, using
+// edge functions on vertices snapped to 1/2^RASTER_SUBPIXEL_BITS of a pixel.
+// Centers exactly on an edge only belong to the triangle when it is a top
+// or left edge, so triangles sharing an edge never cover a pixel twice or
+// leave it out.
+template <int SHADING, int LIGHTING, int TEXTURE>
+void Close2GL_Scene::RasterTriangleHalfSpace(const scene_state_t &state, unsigned int index, const pipeline_varyings_t<SHADING, LIGHTING, TEXTURE> *attrs, tile_rect_t rect)
+{
+  const triangle_t &t = this->triangles[index];
+  const float scale = (float)(1 << RASTER_SUBPIXEL_BITS);
+  int64_t vx[3], vy[3];
+  for (int v = 0; v < 3; v++) {
+    vx[v] = std::llround(t.mapped_vertices[v].x * scale);
+    vy[v] = std::llround(t.mapped_vertices[v].y * scale);
+  }
+
+  // counter clockwise order, the inside is where every edge function is positive
+  int64_t area = (vx[1] - vx[0]) * (vy[2] - vy[0]) - (vy[1] - vy[0]) * (vx[2] - vx[0]);
+  if (area == 0)
+    return;
+  int order[3] = { 0, 1, 2 };
+  if (area < 0) {
+    std::swap(order[1], order[2]);
+    area = -area;
+  }
+
+  // pixel centers are at whole coordinates
+  int64_t min_x = std::min(vx[0], std::min(vx[1], vx[2]));
+  int64_t max_x = std::max(vx[0], std::max(vx[1], vx[2]));
+  int64_t min_y = std::min(vy[0], std::min(vy[1], vy[2]));
+  int64_t max_y = std::max(vy[0], std::max(vy[1], vy[2]));
+  int first_x = std::max<int64_t>(rect.x0, -((-min_x) >> RASTER_SUBPIXEL_BITS));
+  int last_x  = std::min<int64_t>(rect.x1 - 1, max_x >> RASTER_SUBPIXEL_BITS);
+  int first_y = std::max<int64_t>(rect.y0, -((-min_y) >> RASTER_SUBPIXEL_BITS));
+  int last_y  = std::min<int64_t>(rect.y1 - 1, max_y >> RASTER_SUBPIXEL_BITS);
+  if (first_x > last_x || first_y > last_y)
+    return;
+
+  // edge e is opposite to vertex order[e], its function is that vertex weight
+  int64_t row[3], step_x[3], step_y[3], bias[3];
+  for (int e = 0; e < 3; e++)
+  {
+    int a = order[(e+1) % 3], b = order[(e+2) % 3];
+    int64_t dx = vx[b] - vx[a], dy = vy[b] - vy[a];
+    step_x[e] = -dy << RASTER_SUBPIXEL_BITS;
+    step_y[e] =  dx << RASTER_SUBPIXEL_BITS;
+    row[e] = dx * (((int64_t)first_y << RASTER_SUBPIXEL_BITS) - vy[a])
+           - dy * (((int64_t)first_x << RASTER_SUBPIXEL_BITS) - vx[a]);
+    bool top_left = dy < 0 || (dy == 0 && dx < 0);
+    bias[e] = top_left ? 0 : -1;
+  }
 
-    int y, x;
-    glm::vec4 p_a, p_b;
-    interpolating_attr_t attr_a, attr_b;
-    for (int inc_y = 0; inc_y < max_inc; inc_y++)
+  // The edge functions are linear, so their values at the corner pixels of
+  // a block bound every pixel inside it. Blocks outside an edge are skipped
+  // and blocks inside all of them are filled without testing each pixel.
+  float inv_area = 1.0f / (float)area;
+  for (int block_y = first_y & ~(HALF_SPACE_BLOCK - 1); block_y <= last_y; block_y += HALF_SPACE_BLOCK)
+    for (int block_x = first_x & ~(HALF_SPACE_BLOCK - 1); block_x <= last_x; block_x += HALF_SPACE_BLOCK)
     {
-      int inc0 = inc_y;
-      int inc1 = inc_y;  
-      if (active_edge == 2)
-        inc1 -= edges[1].vertex_delta.y;
-
-      p_a = WalkEdge(edges[0], inc0);
-      p_b = WalkEdge(edges[active_edge], inc1);
-      attr_a = Interpolate(edges[0].bottom, edges[0].top, 0, max_inc, inc0);
-      attr_b = Interpolate(edges[active_edge].bottom, edges[active_edge].top, 0, edges[active_edge].vertex_delta.y, inc1);
-
-      this->delta_tex = (attr_b.texture_coords - attr_a.texture_coords);
-      if (std::abs(p_b.x - p_a.x) > 0.0)
-        this->delta_tex /= std::abs(p_b.x - p_a.x);
-      this->delta_tex.x = std::abs(this->delta_tex.x);
-      this->delta_tex.y = std::abs(this->delta_tex.y);
-
-      // ARESTA PRINCIPAL
-      y = std::round(p_a.y);
-      x = std::round(p_a.x);
-    
-      glm::vec4 color = this->ProcessFragment(state, &attr_a, x, y, t.attrs[0]);
-      this->ChangeBuffer(state, x, y, p_a.z, vec4_to_rgba(color));
+      int x0 = std::max(block_x, first_x), x1 = std::min(block_x + HALF_SPACE_BLOCK - 1, last_x);
+      int y0 = std::max(block_y, first_y), y1 = std::min(block_y + HALF_SPACE_BLOCK - 1, last_y);
+
+      bool outside = false, inside = true;
+      for (int e = 0; e < 3; e++)
+      {
+        int64_t c00 = row[e] + (x0 - first_x) * step_x[e] + (y0 - first_y) * step_y[e] + bias[e];
+        int64_t c10 = c00 + (x1 - x0) * step_x[e];
+        int64_t c01 = c00 + (y1 - y0) * step_y[e];
+        int64_t c11 = c10 + (y1 - y0) * step_y[e];
+        outside = outside || std::max(std::max(c00, c10), std::max(c01, c11)) < 0;
+        inside  = inside  && std::min(std::min(c00, c10), std::min(c01, c11)) >= 0;
+      }
+      if (outside)
+        continue;
+
+      // Quads start on even pixels. Lanes outside the block or the triangle 
+      // are still interpolated, for the derivatives, but never written.
+      for (int quad_y = y0 & ~1; quad_y <= y1; quad_y += 2)
+        for (int quad_x = x0 & ~1; quad_x <= x1; quad_x += 2)
+        {
+          float weights[3][QUAD_LANES];
+          int mask = 0;
+          for (int lane = 0; lane < QUAD_LANES; lane++)
+          {
+            int x = quad_x + (lane & 1), y = quad_y + (lane >> 1);
+            int64_t edge[3];
+            for (int e = 0; e < 3; e++) {
+              edge[e] = row[e] + (x - first_x) * step_x[e] + (y - first_y) * step_y[e];
+              weights[order[e]][lane] = edge[e] * inv_area;
+            }
+            bool covered = inside || ((edge[0] + bias[0]) | (edge[1] + bias[1]) | (edge[2] + bias[2])) >= 0;
+            if (covered && x >= x0 && x <= x1 && y >= y0 && y <= y1)
+              mask |= 1 << lane;
+          }
+          if (mask == 0)
+            continue;
+
+          float z[QUAD_LANES];
+          LaneStore(z, LaneInterpolate(LaneLoad(weights[0]), LaneLoad(weights[1]), LaneLoad(weights[2]), 
+                                       t.mapped_vertices[0].z, t.mapped_vertices[1].z, t.mapped_vertices[2].z));
+
+          // the first pass of visibility buffer shading only keeps what is in front
+          if (state.visibility_buffer) {
+            for (int lane = 0; lane < QUAD_LANES; lane++)
+              if (mask & (1 << lane)) {
+                visibility_sample_t sample = { index, { weights[0][lane], weights[1][lane], weights[2][lane] } };
+                this->ChangeVisibility(state, quad_x + (lane & 1), quad_y + (lane >> 1), z[lane], sample);
+              }
+            continue;
+          }
 
-      // ARESTA SECUNDÁRIA
-      y = std::round(p_b.y);
-      x = std::round(p_b.x);
+          if (state.early_z) {
+            for (int lane = 0; lane < QUAD_LANES; lane++)
+              if ((mask & (1 << lane)) && !this->DepthTest(state, quad_x + (lane & 1), quad_y + (lane >> 1), z[lane]))
+                mask &= ~(1 << lane);
+            if (mask == 0)
+              continue;
+          }
+
+          rgba_t pixels[QUAD_LANES];
+          this->ShadeQuad<SHADING, LIGHTING, TEXTURE>(state, attrs, weights, mask, pixels);
+          for (int lane = 0; lane < QUAD_LANES; lane++)
+            if (mask & (1 << lane))
+              this->ChangeBuffer(state, quad_x + (lane & 1), quad_y + (lane >> 1), z[lane], pixels[lane]);
+        }
+    }
+}
 
-      if (std::abs(edges[active_edge].vertex_delta.y) < 0.5f)
+// Second pass of visibility buffer shading, every visible pixel of rect is
+// shaded once. The lanes of a quad that show the same triangle are shaded 
+// together, the others get its weights extrapolated for the derivatives.
+template <int SHADING, int LIGHTING, int TEXTURE>
+void Close2GL_Scene::ResolveVisibility(const scene_state_t &state, const pipeline_varyings_t<SHADING, LIGHTING, TEXTURE> *varyings, tile_rect_t rect)
+{
+  for (int quad_y = rect.y0 & ~1; quad_y < rect.y1; quad_y += 2)
+    for (int quad_x = rect.x0 & ~1; quad_x < rect.x1; quad_x += 2)
+    {
+      const visibility_sample_t *samples[QUAD_LANES];
+      int remaining = 0;
+      for (int lane = 0; lane < QUAD_LANES; lane++)
       {
-        scanline_t sl = FindScanline(
-            edges[active_edge].vertex_top,    edges[active_edge].top, 
-            edges[active_edge].vertex_bottom, edges[active_edge].bottom);
-        this->RasterScanline(state, sl, view_matrix);
+        int x = quad_x + (lane & 1), y = quad_y + (lane >> 1);
+        if (!InsideRect(rect, x, y))
+          continue;
+        samples[lane] = &this->visibility[this->PixelIndex(state, x, y)];
+        if (samples[lane]->triangle != VISIBILITY_EMPTY)
+          remaining |= 1 << lane;
       }
 
-      color = this->ProcessFragment(state, &attr_b, x, y, t.attrs[0]);
-      this->ChangeBuffer(state, x, y, p_b.z, vec4_to_rgba(color));
-      
-      // PREENCHIMENTO
-      if (state.polygon_mode == GL_FILL)
+      while (remaining != 0)
       {
-        float my = (p_a.y + p_b.y) / 2.0f;
-        p_a.y = my;
-        p_b.y = my;
-        scanline_t sl = FindScanline(p_a, attr_a, p_b, attr_b);
-        this->RasterScanline(state, sl, view_matrix);
+        int first = 0;
+        while (!(remaining & (1 << first)))
+          first++;
+        unsigned int index = samples[first]->triangle;
+        int mask = 0;
+        for (int lane = first; lane < QUAD_LANES; lane++)
+          if ((remaining & (1 << lane)) && samples[lane]->triangle == index)
+            mask |= 1 << lane;
+        remaining &= ~mask;
+
+        const triangle_t &t = this->triangles[index];
+        glm::vec3 weights_dx, weights_dy;
+        BarycentricGradients(t.mapped_vertices, &weights_dx, &weights_dy);
+
+        float weights[3][QUAD_LANES];
+        for (int lane = 0; lane < QUAD_LANES; lane++)
+        {
+          const visibility_sample_t *sample = samples[(mask & (1 << lane)) ? lane : first];
+          float dx = (mask & (1 << lane)) ? 0.0f : (float)((lane & 1) - (first & 1));
+          float dy = (mask & (1 << lane)) ? 0.0f : (float)((lane >> 1) - (first >> 1));
+          for (int v = 0; v < 3; v++)
+            weights[v][lane] = sample->weights[v] + dx * weights_dx[v] + dy * weights_dy[v];
+        }
+
+        rgba_t pixels[QUAD_LANES];
+        this->ShadeQuad<SHADING, LIGHTING, TEXTURE>(state, &varyings[3 * index], weights, mask, pixels);
+        for (int lane = 0; lane < QUAD_LANES; lane++)
+          if (mask & (1 << lane))
+            this->color_buffer[this->PixelIndex(state, quad_x + (lane & 1), quad_y + (lane >> 1))] = pixels[lane];
       }
+    }
+}
 
-      if (active_edge == 1 && p_b.y > edges[1].vertex_bottom.y)
-        active_edge = 2;
+// A varying of the three vertices of a triangle at each lane of a quad
+template <int VARYING, int LAYOUT>
+quad_vec4_t QuadVarying(lane_t w0, lane_t w1, lane_t w2, const varyings_t<LAYOUT> *attrs, int term = 0)
+{
+  return QuadInterpolate(w0, w1, w2, Varying<VARYING>(attrs[0], term), Varying<VARYING>(attrs[1], term), Varying<VARYING>(attrs[2], term));
+}
+
+// Shades the lanes in mask of a quad into pixels. weights holds the 
+// barycentric weight of each triangle vertex per lane.
+template <int SHADING, int LIGHTING, int TEXTURE>
+void Close2GL_Scene::ShadeQuad(const scene_state_t &state, const pipeline_varyings_t<SHADING, LIGHTING, TEXTURE> *attrs, const float weights[3][QUAD_LANES], int mask, rgba_t *pixels)
+{
+  lane_t w0 = LaneLoad(weights[0]), w1 = LaneLoad(weights[1]), w2 = LaneLoad(weights[2]);
+
+  lane_t ww = LaneInterpolate(w0, w1, w2, attrs[0].ww, attrs[1].ww, attrs[2].ww);
+
+  const bool textured = TEXTURE != PIPELINE_UNTEXTURED;
+  quad_vec4_t base;
+  if (textured)
+  {
+    glm::vec2 coords[3] = { TextureCoords(attrs[0]), TextureCoords(attrs[1]), TextureCoords(attrs[2]) };
+    float u[QUAD_LANES], v[QUAD_LANES];
+    LaneStore(u, LaneDiv(LaneInterpolate(w0, w1, w2, coords[0].x, coords[1].x, coords[2].x), ww));
+    LaneStore(v, LaneDiv(LaneInterpolate(w0, w1, w2, coords[0].y, coords[1].y, coords[2].y), ww));
+
+    // one level of detail for the quad, from its horizontal and vertical differences
+    glm::vec2 delta_tex = glm::max(
+        glm::abs(glm::vec2(u[1] - u[0], v[1] - v[0])), 
+        glm::abs(glm::vec2(u[2] - u[0], v[2] - v[0])));
+    if (!std::isfinite(delta_tex.x) || !std::isfinite(delta_tex.y))
+      delta_tex = glm::vec2(0.0f);
+
+    float texels[4][QUAD_LANES];
+    for (int lane = 0; lane < QUAD_LANES; lane++)
+    {
+      glm::vec4 texel = (mask & (1 << lane)) ? this->GetTextureColor<TEXTURE>(state, glm::vec2(u[lane], v[lane]), delta_tex) : glm::vec4(0.0f);
+      for (int c = 0; c < 4; c++)
+        texels[c][lane] = texel[c];
+    }
+    base = { LaneLoad(texels[0]), LaneLoad(texels[1]), LaneLoad(texels[2]), LaneLoad(texels[3]) };
+  }
+  else
+    base = QuadDivide(QuadVarying<VARYING_COLOR>(w0, w1, w2, attrs), ww);
+
+  quad_vec4_t color;
+  switch (SHADING)
+  {
+    case FLAT_SHADING:
+      if (textured)
+        color = QuadAdd(QuadAdd(
+            QuadMul(base, QuadSet(Varying<VARYING_FLAT_TERMS>(attrs[0], 0))), 
+            QuadMul(base, QuadSet(Varying<VARYING_FLAT_TERMS>(attrs[0], 1)))), 
+            QuadSet(Varying<VARYING_FLAT_TERMS>(attrs[0], 2)));
+      else
+        color = QuadSet(Varying<VARYING_FLAT_COLOR>(attrs[0]));
+      break;
+
+    case PHONG_SHADING:
+    case FLAT_PHONG_SHADING:
+    {
+      quad_vec4_t position = QuadDivide(QuadVarying<VARYING_CCS_POSITION>(w0, w1, w2, attrs), ww);
+      quad_vec4_t normal;
+      if (SHADING == PHONG_SHADING)
+        normal = QuadDivide(QuadVarying<VARYING_CCS_NORMAL>(w0, w1, w2, attrs), ww);
+      else
+        normal = QuadSet(Varying<VARYING_FLAT_NORMAL>(attrs[0]));
+      color = QuadLighting<LIGHTING>(base, normal, position);
+      break;
     }
+
+    case GOURAUD_SHADING:
+      if (textured) {
+        quad_vec4_t ambient  = QuadDivide(QuadVarying<VARYING_GOURAUD_TERMS>(w0, w1, w2, attrs, 0), ww);
+        quad_vec4_t diffuse  = QuadDivide(QuadVarying<VARYING_GOURAUD_TERMS>(w0, w1, w2, attrs, 1), ww);
+        quad_vec4_t specular = QuadDivide(QuadVarying<VARYING_GOURAUD_TERMS>(w0, w1, w2, attrs, 2), ww);
+        color = QuadAdd(QuadAdd(QuadMul(base, ambient), QuadMul(base, diffuse)), specular);
+        break;
+      }
+      // untextured Gouraud has its lit color in the base, like NO_SHADING
+      [[fallthrough]];
+
+    case NO_SHADING:
+    default:
+      color = base;
   }
+
+  float gamma = 1.0f / 2.2f;
+  float r[QUAD_LANES], g[QUAD_LANES], b[QUAD_LANES], a[QUAD_LANES];
+  LaneStore(r, color.x);
+  LaneStore(g, color.y);
+  LaneStore(b, color.z);
+  LaneStore(a, color.w);
+  for (int lane = 0; lane < QUAD_LANES; lane++)
+    if (mask & (1 << lane)) {
+      pixels[lane].r = std::pow(r[lane], gamma);
+      pixels[lane].g = std::pow(g[lane], gamma);
+      pixels[lane].b = std::pow(b[lane], gamma);
+      pixels[lane].a = std::pow(a[lane], gamma);
+    }
 }
 
-void Close2GL_Scene::RasterScanline(scene_state_t state, scanline_t line, glm::mat4 view_matrix)
+template <int SHADING, int LIGHTING, int TEXTURE>
+void Close2GL_Scene::RasterScanline(const scene_state_t &state, const scanline_t<VaryingsLayout(SHADING, LIGHTING, TEXTURE)> &line, tile_rect_t rect, glm::vec2 delta_tex)
 {
   int max_inc = std::ceil(line.vertex_delta.x);
   int x, y;
   float z;
   y = std::round((line.vertex_top.y + line.vertex_bottom.y) / 2.0f);
-  for (int inc_x = 0; inc_x < max_inc; inc_x++)
+  if (y < rect.y0 || y >= rect.y1)
+    return;
+
+  // scissor the span to the tile, it may start far out in the guard band
+  int first_inc = std::max(0, (int)std::floor(rect.x0 - 0.5f - line.vertex_top.x));
+  int last_inc  = std::min(max_inc, (int)std::ceil(rect.x1 + 0.5f - line.vertex_top.x));
+  for (int inc_x = first_inc; inc_x < last_inc; inc_x++)
   {
     z = line.vertex_top.z + inc_x * line.inc_z;
     x = std::round(line.vertex_top.x + inc_x);
+    if (!InsideRect(rect, x, y))
+      continue;
 
-    interpolating_attr_t attr = Interpolate(line.bottom, line.top, 0, max_inc, inc_x);
+    if (state.early_z && !this->DepthTest(state, x, y, z))
+      continue;
+
+    pipeline_varyings_t<SHADING, LIGHTING, TEXTURE> attr = Interpolate(line.bottom, line.top, 0, max_inc, inc_x);
 
     glm::vec4 color;
-    color = this->ProcessFragment(state, &attr, x, y, attr);
+    color = this->ProcessFragment<SHADING, LIGHTING, TEXTURE>(state, &attr, attr, delta_tex);
 
     this->ChangeBuffer(state, x, y, z, vec4_to_rgba(color));
   }
 }
 
-void Close2GL_Scene::ChangeBuffer(scene_state_t state, int x, int y, float z, rgba_t color)
+int Close2GL_Scene::PixelIndex(const scene_state_t &state, int x, int y)
+{
+  return (state.screen_height - y -1)*state.screen_width+x % this->buffer_size;
+}
+
+// Depth test without the write, so hidden fragments can be dropped before
+// they are shaded. ChangeBuffer still tests again when it writes.
+bool Close2GL_Scene::DepthTest(const scene_state_t &state, int x, int y, float z)
+{
+  if (!InsideScreen(state, x, y))
+    return false;
+  return z < this->depth_buffer[this->PixelIndex(state, x, y)];
+}
+
+void Close2GL_Scene::ChangeVisibility(const scene_state_t &state, int x, int y, float z, visibility_sample_t sample)
+{
+  if (!InsideScreen(state, x, y))
+    return;
+  int index = this->PixelIndex(state, x, y);
+  if (z < this->depth_buffer[index])
+  {
+    this->depth_buffer[index] = z;
+    this->visibility[index] = sample;
+  }
+}
+
+void Close2GL_Scene::ChangeBuffer(const scene_state_t &state, int x, int y, float z, rgba_t color)
 {
-  if (x < 0 || y < 0 || x >= state.screen_width || y >= state.screen_height)
+  if (!InsideScreen(state, x, y))
     return;
-  int index = (state.screen_height - y -1)*state.screen_width+x % this->buffer_size;
+  int index = this->PixelIndex(state, x, y);
   if (z < this->depth_buffer[index])
   {
     this->depth_buffer[index] = z;
@@ -713,6 +1446,93 @@ void Close2GL_Scene::ChangeBuffer(scene_state_t state, int x, int y, float z, rg
 
 /* ==================== Close2GL AUXILIAR ====================== */
 
+bool InsideScreen(const scene_state_t &state, int x, int y)
+{
+  return x >= 0 && y >= 0 && x < state.screen_width && y < state.screen_height;
+}
+
+bool InsideRect(tile_rect_t rect, int x, int y)
+{
+  return x >= rect.x0 && y >= rect.y0 && x < rect.x1 && y < rect.y1;
+}
+
+// Change of the barycentric weights of the three vertices per pixel step
+void BarycentricGradients(const glm::vec4 *v, glm::vec3 *dx, glm::vec3 *dy)
+{
+  float det = (v[1].y - v[2].y) * (v[0].x - v[2].x) + (v[2].x - v[1].x) * (v[0].y - v[2].y);
+  dx->x = (v[1].y - v[2].y) / det;
+  dy->x = (v[2].x - v[1].x) / det;
+  dx->y = (v[2].y - v[0].y) / det;
+  dy->y = (v[0].x - v[2].x) / det;
+  dx->z = -dx->x - dx->y;
+  dy->z = -dy->x - dy->y;
+}
+
+// Signed distance to a clipping plane, positive inside. The guard band 
+// replaces the side planes of the frustum.
+float ClipDistance(glm::vec4 v, int plane, float guard_band)
+{
+  switch (plane)
+  {
+    case 0: return v.z + v.w;
+    case 1: return v.w - v.z;
+    case 2: return v.x + guard_band * v.w;
+    case 3: return guard_band * v.w - v.x;
+    case 4: return v.y + guard_band * v.w;
+    default: return guard_band * v.w - v.y;
+  }
+}
+
+clip_vertex_t ClipLerp(clip_vertex_t a, clip_vertex_t b, float t)
+{
+  clip_vertex_t v;
+  v.position       = a.position       + t * (b.position       - a.position);
+  v.normal         = a.normal         + t * (b.normal         - a.normal);
+  v.color          = a.color          + t * (b.color          - a.color);
+  v.texture_coords = a.texture_coords + t * (b.texture_coords - a.texture_coords);
+  return v;
+}
+
+// Sutherland-Hodgman in homogeneous space, before the perspective divide, 
+// so the attributes are interpolated linearly. The polygon must have room 
+// for CLIP_MAX_VERTICES; returns the new vertex count, 0 when nothing is left.
+int ClipPolygon(clip_vertex_t *polygon, int count, unsigned char planes, float guard_band)
+{
+  clip_vertex_t input[CLIP_MAX_VERTICES];
+  for (int plane = 0; plane < 6 && count > 0; plane++)
+  {
+    if (plane == 0 && !(planes & CLIP_NEAR)) continue;
+    if (plane == 1 && !(planes & CLIP_FAR)) continue;
+    if (plane >= 2 && !(planes & CLIP_GUARD_BAND)) break;
+
+    std::copy(polygon, polygon + count, input);
+    int input_count = count;
+    count = 0;
+
+    for (int i = 0; i < input_count; i++)
+    {
+      clip_vertex_t a = input[i];
+      clip_vertex_t b = input[(i+1) % input_count];
+      float da = ClipDistance(a.position, plane, guard_band);
+      float db = ClipDistance(b.position, plane, guard_band);
+
+      if (da >= 0.0f)
+        polygon[count++] = a;
+      if ((da >= 0.0f) != (db >= 0.0f))
+        polygon[count++] = ClipLerp(a, b, da / (da - db));
+    }
+  }
+  return count;
+}
+
+// Calculated normals flip with the front face, so instead of calculating 
+// them again they are negated while rendering
+float NormalSign(scene_state_t state, bool calculated_ccw)
+{
+  bool calculated = state.use_calculated_normals && !state.use_raw_normals;
+  return calculated && calculated_ccw != (state.front_face == GL_CCW) ? -1.0f : 1.0f;
+}
+
 rgba_t vec4_to_rgba(glm::vec4 vec)
 {
   rgba_t c;
@@ -723,16 +1543,6 @@ rgba_t vec4_to_rgba(glm::vec4 vec)
   return c;
 }
 
-void EraseTriangleWithVertex(std::vector<model_triangle_t> *triangles, int index)
-{
-  auto it = triangles->begin();
-  while (it != triangles->end())
-    if (it->indices[0] == index || it->indices[1] == index || it->indices[2] == index)
-      it = triangles->erase(it);
-    else
-      it++;
-}
-
 bool FaceCulling(glm::vec4 *vertices, int face_orientation)
 {
   glm::vec4 v0 = vertices[0];
@@ -744,9 +1554,10 @@ bool FaceCulling(glm::vec4 *vertices, int face_orientation)
   return (face_orientation == GL_CW) && (a > 0) || (a < 0);
 }
 
-edge_t FindEdge(glm::vec4 v0, interpolating_attr_t v0_attr, glm::vec4 v1, interpolating_attr_t v1_attr)
+template <int LAYOUT>
+edge_t<LAYOUT> FindEdge(glm::vec4 v0, const varyings_t<LAYOUT> &v0_attr, glm::vec4 v1, const varyings_t<LAYOUT> &v1_attr)
 {
-  edge_t e;
+  edge_t<LAYOUT> e;
 
   if (v0.y < v1.y) {
     e.vertex_top    = v0;
@@ -779,9 +1590,10 @@ edge_t FindEdge(glm::vec4 v0, interpolating_attr_t v0_attr, glm::vec4 v1, interp
   return e;
 }
 
-scanline_t FindScanline(glm::vec4 v0, interpolating_attr_t v0_attr, glm::vec4 v1, interpolating_attr_t v1_attr)
+template <int LAYOUT>
+scanline_t<LAYOUT> FindScanline(glm::vec4 v0, const varyings_t<LAYOUT> &v0_attr, glm::vec4 v1, const varyings_t<LAYOUT> &v1_attr)
 {
-  scanline_t sl;
+  scanline_t<LAYOUT> sl;
 
   if (v0.x < v1.x) {
     sl.vertex_top    = v0;
@@ -804,7 +1616,10 @@ scanline_t FindScanline(glm::vec4 v0, interpolating_attr_t v0_attr, glm::vec4 v1
   return sl;
 }
 
-edge_t* OrderEdges(edge_t* edges)
+// Writes the three edges into ordered: the tallest first, then the edges
+// from its top and bottom, as the scanline walk visits them
+template <int LAYOUT>
+void OrderEdges(const edge_t<LAYOUT> *edges, edge_t<LAYOUT> *ordered)
 {
   float bottom_y = 0.0f, 
     top_y = std::numeric_limits<float>::max(), 
@@ -818,52 +1633,71 @@ edge_t* OrderEdges(edge_t* edges)
     has_horizontal_edge = has_horizontal_edge || (edges[i].vertex_delta.y == 0.0f);
   }
 
-  edge_t* new_edges = new edge_t[3];
+  bool filled[3] = { false, false, false };
+  for (int i = 0; i < 3; i++)
+    if (has_horizontal_edge && edges[i].vertex_delta.y == 0.0f) {
+      int slot = edges[i].vertex_top.y == top_y ? 1 : 2;
+      ordered[slot] = edges[i];
+      filled[slot] = true;
+    }
+
   for (int i = 0; i < 3; i++)
   {
     if (has_horizontal_edge)
       if (edges[i].vertex_delta.y == 0.0f)
-        if (edges[i].vertex_top.y == top_y)
-          new_edges[1] = edges[i];
-        else
-          new_edges[2] = edges[i];
-      else
-        if (new_edges[0].vertex_top.w == 0.0f)
-          new_edges[0] = edges[i];
-        else
-          if (new_edges[1].vertex_top.w == 0.0f)
-            new_edges[1] = edges[i];
-          else
-            new_edges[2] = edges[i];
+        continue;
+      else {
+        // the sloped edges take the slots the horizontal one left free
+        int slot = !filled[0] ? 0 : (!filled[1] ? 1 : 2);
+        ordered[slot] = edges[i];
+        filled[slot] = true;
+      }
     else
       if (edges[i].vertex_top.y == top_y)
         if (edges[i].vertex_bottom.y == bottom_y)
-          new_edges[0] = edges[i];
+          ordered[0] = edges[i];
         else
-          new_edges[1] = edges[i];
+          ordered[1] = edges[i];
       else
-        new_edges[2] = edges[i];    
+        ordered[2] = edges[i];    
+  }
+}
+
+// Lighting part of the pipeline key of a draw, one of the three modes the
+// interface offers; the ambient term is always on
+int PipelineLighting(const scene_state_t &state)
+{
+  switch (state.lighting_mode)
+  {
+    case AMBIENT_LIGHT:
+    case AMBIENT_LIGHT + DIFFUSE_LIGHT:
+      return state.lighting_mode;
+    default:
+      return AMBIENT_LIGHT + DIFFUSE_LIGHT + SPECULAR_LIGHT;
   }
+}
 
-  return new_edges;
+// Texture part of the pipeline key of a draw
+int PipelineTexture(const scene_state_t &state, bool has_texture)
+{
+  if (!state.enable_texture || !has_texture)
+    return PIPELINE_UNTEXTURED;
+  if (state.texture_filter == GL_LINEAR || state.texture_filter == GL_LINEAR_MIPMAP_LINEAR)
+    return state.texture_filter;
+  return GL_NEAREST;
 }
 
-interpolating_attr_t Interpolate(interpolating_attr_t attr_0, interpolating_attr_t attr_1, float min, float max, float value)
+// The flat varyings are copied from attr_0
+template <int LAYOUT>
+varyings_t<LAYOUT> Interpolate(const varyings_t<LAYOUT> &attr_0, const varyings_t<LAYOUT> &attr_1, float min, float max, float value)
 {
   float alpha = (value - min) / (max - min);
-  interpolating_attr_t result;
-  result.color        = alpha * attr_0.color        + (1.0f - alpha) * attr_1.color;
-  result.ccs_normal   = alpha * attr_0.ccs_normal   + (1.0f - alpha) * attr_1.ccs_normal;
-  result.ccs_position = alpha * attr_0.ccs_position + (1.0f - alpha) * attr_1.ccs_position;
-  result.texture_coords = alpha * attr_0.texture_coords + (1.0f - alpha) * attr_1.texture_coords;
-  result.ww           = alpha * attr_0.ww           + (1.0f - alpha) * attr_1.ww;
-
-  result.vColorAmbient = alpha * attr_0.vColorAmbient + (1.0f - alpha) * attr_1.vColorAmbient;
-  result.vColorDiffuse = alpha * attr_0.vColorDiffuse + (1.0f - alpha) * attr_1.vColorDiffuse;
-  result.vColorSpecular = alpha * attr_0.vColorSpecular + (1.0f - alpha) * attr_1.vColorSpecular;
-
-  result.flatColor     = attr_0.flatColor;
-  result.flatCcsNormal = attr_0.flatCcsNormal;
+  varyings_t<LAYOUT> result;
+  result.ww = alpha * attr_0.ww + (1.0f - alpha) * attr_1.ww;
+  for (int i = 0; i < varyings_t<LAYOUT>::INTERPOLATED; i++)
+    result.v[i] = alpha * attr_0.v[i] + (1.0f - alpha) * attr_1.v[i];
+  for (int i = varyings_t<LAYOUT>::INTERPOLATED; i < varyings_t<LAYOUT>::SIZE; i++)
+    result.v[i] = attr_0.v[i];
   return result;
 }
 
@@ -893,84 +1727,77 @@ glm::vec4 SpecularLighting(glm::vec4 ccs_normal, glm::vec4 ccs_position)
   return glm::vec4(0.5,0.5,0.5,1.0) * std::pow(std::max(0.0f, glm::dot(h, r)), q);
 }
 
-glm::vec4 Lighting(scene_state_t state, interpolating_attr_t attr, glm::vec4 normal)
+// Lighting for the four lanes of a quad
+template <int LIGHTING>
+quad_vec4_t QuadLighting(quad_vec4_t color, quad_vec4_t normal, quad_vec4_t ccs_position)
 {
-  int lighting = state.lighting_mode;
-
-  int count_terms = 0;
-  glm::vec4 specular_term = glm::vec4(0.0,0.0,0.0,1.0);
-  if (lighting >= SPECULAR_LIGHT) {
-    lighting -= SPECULAR_LIGHT;
-    specular_term = SpecularLighting(normal, attr.ccs_position);
-    count_terms++;
+  quad_vec4_t n = QuadNormalize(normal);
+  quad_vec4_t l = QuadNormalize(QuadSub(QuadSet(glm::vec4(2.0,2.0,2.0,1.0)), ccs_position));
+  lane_t zero = LaneSet(0.0f);
+
+  quad_vec4_t specular_term = QuadSet(glm::vec4(0.0,0.0,0.0,1.0));
+  if (LIGHTING & SPECULAR_LIGHT) {
+    quad_vec4_t v = QuadNormalize(QuadSub(QuadSet(glm::vec4(0.0,0.0,0.0,1.0)), ccs_position));
+    quad_vec4_t r = QuadNormalize(QuadSub(QuadScale(QuadScale(n, LaneSet(2.0f)), QuadDot(l, n)), l));
+    quad_vec4_t h = QuadNormalize(QuadAdd(v, l));
+    lane_t s = LanePow(LaneMax(zero, QuadDot(h, r)), 120.0f);
+    specular_term = QuadScale(QuadSet(glm::vec4(0.5,0.5,0.5,1.0)), s);
   }
 
-  glm::vec4 diffuse_term = glm::vec4(0.0,0.0,0.0,1.0);
-  if (lighting >= DIFFUSE_LIGHT) {
-    lighting -= DIFFUSE_LIGHT;
-    diffuse_term = DiffuseLighting(attr.color, normal, attr.ccs_position);
-    count_terms++;
-  }
-  
-  glm::vec4 ambient_term = glm::vec4(0.0,0.0,0.0,1.0);
-  if (lighting >= AMBIENT_LIGHT) {
-    lighting -= AMBIENT_LIGHT;
-    ambient_term = AmbientLighting(attr.color);
-    count_terms++;
-  }
+  quad_vec4_t diffuse_term = QuadSet(glm::vec4(0.0,0.0,0.0,1.0));
+  if (LIGHTING & DIFFUSE_LIGHT)
+    diffuse_term = QuadScale(color, LaneMax(zero, QuadDot(n, l)));
 
-  return ambient_term + diffuse_term + specular_term;
+  quad_vec4_t ambient_term = QuadSet(glm::vec4(0.0,0.0,0.0,1.0));
+  if (LIGHTING & AMBIENT_LIGHT)
+    ambient_term = QuadScale(color, LaneSet(0.2f));
+
+  return QuadAdd(QuadAdd(ambient_term, diffuse_term), specular_term);
 }
 
-glm::vec4 LightingWithTextureMapping(scene_state_t state, interpolating_attr_t attr, glm::vec4 color, glm::vec4 normal)
+// LIGHTING is a sum of AMBIENT_LIGHT, DIFFUSE_LIGHT and SPECULAR_LIGHT
+template <int LIGHTING>
+glm::vec4 Lighting(glm::vec4 color, glm::vec4 normal, glm::vec4 ccs_position)
 {
-  int lighting = state.lighting_mode;
-
-  int count_terms = 0;
   glm::vec4 specular_term = glm::vec4(0.0,0.0,0.0,1.0);
-  if (lighting >= SPECULAR_LIGHT) {
-    lighting -= SPECULAR_LIGHT;
-    specular_term = SpecularLighting(normal, attr.ccs_position);
-    count_terms++;
-  }
+  if (LIGHTING & SPECULAR_LIGHT)
+    specular_term = SpecularLighting(normal, ccs_position);
 
   glm::vec4 diffuse_term = glm::vec4(0.0,0.0,0.0,1.0);
-  if (lighting >= DIFFUSE_LIGHT) {
-    lighting -= DIFFUSE_LIGHT;
-    diffuse_term = DiffuseLighting(color, normal, attr.ccs_position);
-    count_terms++;
-  }
+  if (LIGHTING & DIFFUSE_LIGHT)
+    diffuse_term = DiffuseLighting(color, normal, ccs_position);
   
   glm::vec4 ambient_term = glm::vec4(0.0,0.0,0.0,1.0);
-  if (lighting >= AMBIENT_LIGHT) {
-    lighting -= AMBIENT_LIGHT;
+  if (LIGHTING & AMBIENT_LIGHT)
     ambient_term = AmbientLighting(color);
-    count_terms++;
-  }
 
   return ambient_term + diffuse_term + specular_term;
 }
 
-void Shading(scene_state_t state, interpolating_attr_t *attr)
+template <int SHADING, int LIGHTING>
+void Shading(vertex_attr_t *attr)
 {
+  if constexpr (SHADING == NO_SHADING) // keeps the unlit color
+    return;
+
   attr->ccs_position /= attr->ww;
   attr->ccs_normal /= attr->ww;
   attr->color /= attr->ww;
 
   glm::vec4 color;
-  switch (state.shading_mode)
+  switch (SHADING)
   {
     case FLAT_SHADING:
     case FLAT_PHONG_SHADING:
-      color = Lighting(state, *attr, attr->flatCcsNormal);
+      color = Lighting<LIGHTING>(attr->color, attr->flatCcsNormal, attr->ccs_position);
       break;
       
     case GOURAUD_SHADING:
     case PHONG_SHADING:
-      color = Lighting(state, *attr, attr->ccs_normal);
+      color = Lighting<LIGHTING>(attr->color, attr->ccs_normal, attr->ccs_position);
   }
 
-  if (state.shading_mode == FLAT_SHADING)
+  if (SHADING == FLAT_SHADING)
     attr->flatColor = color;
   else
     attr->color = color;
@@ -980,6 +1807,24 @@ void Shading(scene_state_t state, interpolating_attr_t *attr)
   attr->color *= attr->ww;
 }
 
+// Phong lighting of a fragment, in place like the lighting of a vertex
+template <int SHADING, int LIGHTING, int LAYOUT>
+void Shading(varyings_t<LAYOUT> *attr)
+{
+  glm::vec4 position = Varying<VARYING_CCS_POSITION>(*attr) / attr->ww;
+  glm::vec4 normal = Varying<VARYING_CCS_NORMAL>(*attr) / attr->ww;
+  glm::vec4 color = Varying<VARYING_COLOR>(*attr) / attr->ww;
+
+  if (SHADING == FLAT_PHONG_SHADING)
+    color = Lighting<LIGHTING>(color, Varying<VARYING_FLAT_NORMAL>(*attr), position);
+  else
+    color = Lighting<LIGHTING>(color, normal, position);
+
+  SetVarying<VARYING_CCS_POSITION>(attr, position * attr->ww);
+  SetVarying<VARYING_CCS_NORMAL>(attr, normal * attr->ww);
+  SetVarying<VARYING_COLOR>(attr, color * attr->ww);
+}
+
 void PrintTriangle(triangle_t t)
 {
   PrintVec4(t.vertices[0]);
@@ -987,7 +1832,8 @@ void PrintTriangle(triangle_t t)
   PrintVec4(t.vertices[2]);
 }
 
-void PrintEdge(edge_t e)
+template <int LAYOUT>
+void PrintEdge(const edge_t<LAYOUT> &e)
 {
   printf("[ %+0.2f  %+0.2f  %+0.2f  %+0.2f ] >> [ %+0.2f  %+0.2f  %+0.2f  %+0.2f ]\n", 
       e.vertex_top.x, e.vertex_top.y, e.vertex_top.z, e.vertex_top.w, 